@@ -0,0 +1,67 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include <chrono>
+#include <algorithm>
+
+#include "sampling.h"
+
+namespace ygg {
+
+// Picks a worker's transfer size by AIMD. Transfers are grouped into
+// epochs of about a millisecond. After each epoch the size grows by
+// min_size, unless most transfers in it came back short (the pipe held
+// less data, or had less room, than was asked for) or throughput fell more
+// than 10% below its running average, in which case the size is halved
+// (rounded down to a multiple of min_size).
+// Sizes are in whatever unit the worker transfers.
+class chunk_controller {
+    size_t min_size;
+    size_t max_size;
+    size_t current;
+
+    clock::time_point epoch_start;
+    size_t epoch_amount;
+    size_t transfers;
+    size_t short_transfers;
+    double average_rate;
+
+    public:
+        chunk_controller(size_t initial, size_t min_size, size_t max_size) :
+            min_size(std::max<size_t>(min_size, 1)),
+            max_size(std::max(min_size, max_size)),
+            current(std::min(std::max(initial, this->min_size), this->max_size)),
+            epoch_start(clock::now()),
+            epoch_amount(0),
+            transfers(0),
+            short_transfers(0),
+            average_rate(0) {}
+
+        size_t size() const { return current; }
+
+        // count moved in one transfer of size(); short_transfer if either
+        // side gave or took less than asked for
+        void record(size_t count, bool short_transfer) {
+            epoch_amount += count;
+            transfers++;
+            if (short_transfer) short_transfers++;
+
+            clock::time_point now = clock::now();
+            if (now - epoch_start < std::chrono::milliseconds(1)) return;
+
+            double rate = epoch_amount / std::chrono::duration<double>(now - epoch_start).count();
+            if (short_transfers * 2 > transfers || rate < 0.9 * average_rate) {
+                current = std::max(min_size, current / 2 / min_size * min_size);
+            } else {
+                current = std::min(max_size, current + min_size);
+            }
+            average_rate = average_rate == 0 ? rate : 0.75 * average_rate + 0.25 * rate;
+
+            epoch_start = now;
+            epoch_amount = transfers = short_transfers = 0;
+        }
+};
+
+}
+
+#endif
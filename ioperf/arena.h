@@ -0,0 +1,289 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstdio>
+#include <cstdint>
+#include <fstream>
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "util.h"
+
+namespace ygg {
+
+// How the arena backs its blocks:
+//
+//   normal  4 KiB pages, with transparent huge pages turned off
+//   thp     transparent huge pages (madvise), 2 MiB aligned
+//   huge    hugetlbfs pages (MAP_HUGETLB), falling back to thp if the
+//           kernel has none to spare
+enum class page_mode { normal, thp, huge };
+
+inline char const* page_mode_name(page_mode mode) {
+    switch (mode) {
+        case page_mode::normal: return "normal";
+        case page_mode::thp: return "thp";
+        case page_mode::huge: return "huge";
+    }
+    return "?";
+}
+
+inline page_mode parse_page_mode(std::string const& name) {
+    if (name == "normal" || name == "off") return page_mode::normal;
+    if (name == "huge" || name == "on") return page_mode::huge;
+    return page_mode::thp;
+}
+
+// Hands out aligned regions carved from large mappings. Blocks are a
+// multiple of 2 MiB and prefaulted when mapped, so a run doesn't take page
+// faults on its buffers and the buffers of a run share as few TLB entries
+// as possible. Freed regions are coalesced and a block is unmapped as soon
+// as it is empty again, so a sweep doesn't accumulate memory.
+//
+// The arena is process-wide; pipelines set its mode and node (see
+// memory_binding) before they build their pipes and workers. Prefaulting
+// happens on the allocating thread, so the pages land on the node its
+// memory policy names. Blocks are only reused for the same page mode and
+// node.
+class buffer_arena {
+    static constexpr size_t huge_page_size = 2 << 20;
+    static constexpr size_t small_page_size = 4096;
+
+    struct block {
+        char* base;
+        size_t size;
+        size_t used;
+        std::map<size_t, size_t> free; // offset -> size
+        page_mode backing;
+        int node;
+    };
+
+    std::mutex arena_mutex;
+    std::vector<std::unique_ptr<block>> blocks;
+    page_mode mode;
+    int node;
+    page_mode last_backing;
+
+    static size_t round_up(size_t n, size_t to) { return (n + to - 1) / to * to; }
+
+    // maps size bytes aligned to 2 MiB, so THP can back the whole range
+    static char* map_aligned(size_t size) {
+        size_t len = size + huge_page_size;
+        void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return nullptr;
+
+        uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+        uintptr_t aligned = round_up(addr, huge_page_size);
+        if (aligned > addr) munmap(p, aligned - addr);
+        if (aligned + size < addr + len) munmap(reinterpret_cast<void*>(aligned + size), addr + len - aligned - size);
+        return reinterpret_cast<char*>(aligned);
+    }
+
+    std::unique_ptr<block> map_block(size_t size) {
+        std::unique_ptr<block> res(new block{nullptr, size, 0, {}, mode, node});
+
+        if (mode == page_mode::huge) {
+            void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+            if (p != MAP_FAILED) res->base = static_cast<char*>(p);
+            else res->backing = page_mode::thp;
+        }
+
+        if (!res->base) {
+            res->base = map_aligned(size);
+            if (!res->base) throw std::bad_alloc();
+            madvise(res->base, size, res->backing == page_mode::thp ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+
+            // touch after madvise, so the first fault of each 2 MiB range can
+            // already be served with a huge page
+            for (size_t off = 0; off < size; off += small_page_size) {
+                static_cast<volatile char*>(res->base)[off] = 0;
+            }
+        }
+
+        res->free[0] = size;
+        return res;
+    }
+
+    // first fit within b, or nullptr
+    static char* carve(block& b, size_t n, size_t alignment) {
+        for (auto it = b.free.begin(); it != b.free.end(); ++it) {
+            size_t start = round_up(it->first, alignment);
+            size_t end = it->first + it->second;
+            if (start + n > end) continue;
+
+            size_t head = start - it->first;
+            if (head > 0) it->second = head;
+            else b.free.erase(it);
+            if (start + n < end) b.free[start + n] = end - start - n;
+
+            b.used += n;
+            return b.base + start;
+        }
+        return nullptr;
+    }
+
+    public:
+        buffer_arena() :
+            mode(page_mode::thp),
+            node(-1),
+            last_backing(page_mode::thp) {}
+
+        ~buffer_arena() {
+            for (auto& b : blocks) munmap(b->base, b->size);
+        }
+
+        static buffer_arena& instance() {
+            static buffer_arena arena;
+            return arena;
+        }
+
+        // applies to blocks mapped from now on
+        void set_mode(page_mode new_mode) {
+            std::lock_guard<std::mutex> guard(arena_mutex);
+            mode = new_mode;
+        }
+
+        // applies to blocks mapped from now on: the node the allocating
+        // thread's memory policy points at (-1: none)
+        void set_node(int new_node) {
+            std::lock_guard<std::mutex> guard(arena_mutex);
+            node = new_node;
+        }
+
+        // what the most recently mapped block actually got
+        page_mode backing() {
+            std::lock_guard<std::mutex> guard(arena_mutex);
+            return last_backing;
+        }
+
+        size_t mapped() {
+            std::lock_guard<std::mutex> guard(arena_mutex);
+            size_t res = 0;
+            for (auto const& b : blocks) res += b->size;
+            return res;
+        }
+
+        void* allocate(size_t n, size_t alignment) {
+            n = round_up(std::max<size_t>(n, 1), cache_line_size);
+            std::lock_guard<std::mutex> guard(arena_mutex);
+
+            for (auto& b : blocks) {
+                if (b->backing != mode && !(mode == page_mode::huge && b->backing == page_mode::thp)) continue;
+                if (b->node != node) continue;
+                if (char* p = carve(*b, n, alignment)) return p;
+            }
+
+            blocks.push_back(map_block(round_up(n, huge_page_size)));
+            last_backing = blocks.back()->backing;
+            return carve(*blocks.back(), n, alignment);
+        }
+
+        void deallocate(void* ptr, size_t n) {
+            n = round_up(std::max<size_t>(n, 1), cache_line_size);
+            char* p = static_cast<char*>(ptr);
+            std::lock_guard<std::mutex> guard(arena_mutex);
+
+            for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+                block& b = **it;
+                if (p < b.base || p >= b.base + b.size) continue;
+
+                size_t offset = p - b.base;
+                auto range = b.free.emplace(offset, n).first;
+                auto after = std::next(range);
+                if (after != b.free.end() && after->first == offset + n) {
+                    range->second += after->second;
+                    b.free.erase(after);
+                }
+                if (range != b.free.begin()) {
+                    auto before = std::prev(range);
+                    if (before->first + before->second == offset) {
+                        before->second += range->second;
+                        b.free.erase(range);
+                    }
+                }
+
+                b.used -= n;
+                if (b.used == 0) {
+                    munmap(b.base, b.size);
+                    blocks.erase(it);
+                }
+                return;
+            }
+        }
+};
+
+// Owning array of count Ts from the arena; page aligned if it spans at
+// least a page, cache line aligned otherwise. Elements are not
+// initialised, so T must be trivial.
+template<typename T>
+class arena_buffer {
+    static_assert(std::is_trivial<T>::value, "arena_buffer holds trivial types only");
+
+    T* ptr;
+    size_t count;
+
+    public:
+        explicit arena_buffer(size_t count) :
+            ptr(static_cast<T*>(buffer_arena::instance().allocate(count * sizeof(T),
+                    count * sizeof(T) >= 4096 ? 4096 : cache_line_size))),
+            count(count) {}
+
+        ~arena_buffer() {
+            if (ptr) buffer_arena::instance().deallocate(ptr, count * sizeof(T));
+        }
+
+        arena_buffer(arena_buffer&& other) :
+            ptr(other.ptr),
+            count(other.count)
+        {
+            other.ptr = nullptr;
+        }
+
+        arena_buffer(arena_buffer const&) = delete;
+        arena_buffer& operator=(arena_buffer const&) = delete;
+
+        T* data() { return ptr; }
+        T const* data() const { return ptr; }
+        size_t size() const { return count; }
+
+        T& operator[](size_t i) { return ptr[i]; }
+        T const& operator[](size_t i) const { return ptr[i]; }
+};
+
+// Transparent huge pages actually backing the process, from smaps_rollup;
+// madvise is only a hint, so thp blocks may still be on small pages.
+inline size_t anon_huge_bytes() {
+    std::ifstream ifs("/proc/self/smaps_rollup");
+    std::string key;
+    size_t kib = 0;
+    while (ifs >> key) {
+        if (key == "AnonHugePages:" && ifs >> kib) return kib * 1024;
+        ifs.ignore(SIZE_MAX, '\n');
+    }
+    return 0;
+}
+
+// e.g. "pages: huge, fell back to thp, 4M mapped, 4M on THP"
+inline void print_pages(page_mode requested) {
+    buffer_arena& arena = buffer_arena::instance();
+    page_mode got = arena.backing();
+    printf("pages: %s", page_mode_name(requested));
+    if (got != requested) printf(", fell back to %s", page_mode_name(got));
+    printf(", %s mapped", format_size(arena.mapped()).c_str());
+    if (got == page_mode::thp) printf(", %s on THP", format_size(anon_huge_bytes()).c_str());
+    printf("\n");
+}
+
+}
+
+#endif
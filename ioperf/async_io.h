@@ -0,0 +1,510 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+namespace ygg {
+
+// A ring of equally sized, page-aligned I/O buffers against one file, with
+// up to depth reads or writes in flight. Each slot carries at most one
+// operation at a time; wait() blocks until the slot's operation completed
+// and returns its result (bytes transferred or -errno). Once failed(), a
+// backend takes no more requests, and a slot it could not see complete
+// keeps its buffer: the kernel may still be reading or writing it.
+class async_io {
+    protected:
+        int fd;
+        size_t block_size;
+        std::vector<char*> buffers;
+
+    public:
+        async_io(int fd, size_t depth, size_t block_size) :
+            fd(fd),
+            block_size(block_size),
+            buffers(depth)
+        {
+            for (auto& buf : buffers) {
+                void* ptr = nullptr;
+                if (posix_memalign(&ptr, 4096, block_size) != 0) ptr = nullptr;
+                buf = static_cast<char*>(ptr);
+            }
+        }
+
+        virtual ~async_io() {
+            for (auto buf : buffers) free(buf);
+        }
+
+        size_t depth() const { return buffers.size(); }
+        char* buffer(size_t slot) { return buffers[slot]; }
+
+        virtual char const* name() const = 0;
+        virtual void submit_read(size_t slot, off_t offset, size_t len) = 0;
+        virtual void submit_write(size_t slot, off_t offset, size_t len) = 0;
+        virtual ssize_t wait(size_t slot) = 0;
+        virtual bool failed() const { return false; }
+};
+
+// io_uring backend talking to the kernel through the raw syscalls. The
+// buffer ring is registered up front so reads and writes use the _FIXED
+// opcodes and skip the per-request page pinning.
+class uring_io : public async_io {
+    int ring_fd;
+
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+
+    std::vector<ssize_t> results;
+    std::vector<bool> done;
+    int error;
+
+    static int setup(unsigned entries, io_uring_params* p) {
+        return syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    static int enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    static int do_register(int fd, unsigned opcode, void const* arg, unsigned nr_args) {
+        return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+    }
+
+    void submit(unsigned char opcode, size_t slot, off_t offset, size_t len) {
+        if (error) {
+            results[slot] = -error;
+            return;
+        }
+
+        unsigned tail = *sq_tail;
+        unsigned idx = tail & *sq_mask;
+
+        io_uring_sqe* sqe = &sqes[idx];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->off = offset;
+        sqe->addr = reinterpret_cast<uint64_t>(buffers[slot]);
+        sqe->len = len;
+        sqe->buf_index = slot;
+        sqe->user_data = slot;
+
+        sq_array[idx] = idx;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        done[slot] = false;
+        while (enter(ring_fd, 1, 0, 0) < 0) {
+            if (errno == EINTR) continue;
+
+            // the kernel never took the request, so the slot is free again
+            error = errno;
+            results[slot] = -error;
+            done[slot] = true;
+            break;
+        }
+    }
+
+    void reap() {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            io_uring_cqe* cqe = &cqes[head & *cq_mask];
+            results[cqe->user_data] = cqe->res;
+            done[cqe->user_data] = true;
+        }
+
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    public:
+        uring_io(int fd, size_t depth, size_t block_size) :
+            async_io(fd, depth, block_size),
+            ring_fd(-1),
+            sq_ptr(MAP_FAILED),
+            cq_ptr(MAP_FAILED),
+            sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+            results(depth, 0),
+            done(depth, true),
+            error(0)
+        {
+            io_uring_params p;
+            std::memset(&p, 0, sizeof(p));
+
+            ring_fd = setup(depth, &p);
+            if (ring_fd < 0) return;
+
+            sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+            if (p.features & IORING_FEAT_SINGLE_MMAP) sq_size = cq_size = std::max(sq_size, cq_size);
+
+            sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+            if (sq_ptr == MAP_FAILED) return;
+
+            if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                cq_ptr = sq_ptr;
+            } else {
+                cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+                if (cq_ptr == MAP_FAILED) return;
+            }
+
+            sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+            sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+            if (sqes == MAP_FAILED) return;
+
+            char* sq = static_cast<char*>(sq_ptr);
+            sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+            sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+            sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+            char* cq = static_cast<char*>(cq_ptr);
+            cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+            cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+            std::vector<iovec> iov(depth);
+            for (size_t i = 0; i < depth; i++) iov[i] = {buffers[i], block_size};
+            if (do_register(ring_fd, IORING_REGISTER_BUFFERS, iov.data(), depth) < 0) {
+                close(ring_fd);
+                ring_fd = -1;
+            }
+        }
+
+        virtual ~uring_io() {
+            if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+            if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+            if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+            if (ring_fd >= 0) close(ring_fd);
+        }
+
+        bool ok() const {
+            return ring_fd >= 0 && sq_ptr != MAP_FAILED && cq_ptr != MAP_FAILED && sqes != MAP_FAILED;
+        }
+
+        virtual char const* name() const override { return "io_uring"; }
+        virtual bool failed() const override { return error != 0; }
+
+        virtual void submit_read(size_t slot, off_t offset, size_t len) override {
+            submit(IORING_OP_READ_FIXED, slot, offset, len);
+        }
+
+        virtual void submit_write(size_t slot, off_t offset, size_t len) override {
+            submit(IORING_OP_WRITE_FIXED, slot, offset, len);
+        }
+
+        virtual ssize_t wait(size_t slot) override {
+            reap();
+            while (!done[slot]) {
+                if (error) return -error;
+                if (enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                    // the request may still be in flight, so the slot stays busy
+                    error = errno;
+                    perror("io_uring_enter");
+                }
+                reap();
+            }
+            return results[slot];
+        }
+};
+
+// Fallback for kernels without io_uring (or where it is blocked): one
+// thread per slot of queue depth doing plain pread/pwrite.
+class thread_pool_io : public async_io {
+    struct request {
+        size_t slot;
+        off_t offset;
+        size_t len;
+        bool write;
+    };
+
+    std::vector<std::thread> threads;
+    std::deque<request> queue;
+    std::vector<ssize_t> results;
+    std::vector<bool> done;
+    bool stopped;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::condition_variable done_cv;
+
+    void run() {
+        std::unique_lock<std::mutex> guard(queue_mutex);
+
+        while (true) {
+            queue_cv.wait(guard, [this]{return !queue.empty() || stopped;});
+            if (queue.empty()) return;
+
+            request req = queue.front();
+            queue.pop_front();
+            guard.unlock();
+
+            ssize_t res = req.write
+                ? pwrite(fd, buffers[req.slot], req.len, req.offset)
+                : pread(fd, buffers[req.slot], req.len, req.offset);
+            if (res < 0) res = -errno;
+
+            guard.lock();
+            results[req.slot] = res;
+            done[req.slot] = true;
+            done_cv.notify_all();
+        }
+    }
+
+    void submit(request req) {
+        std::unique_lock<std::mutex> guard(queue_mutex);
+        done[req.slot] = false;
+        queue.push_back(req);
+        guard.unlock();
+        queue_cv.notify_one();
+    }
+
+    public:
+        thread_pool_io(int fd, size_t depth, size_t block_size) :
+            async_io(fd, depth, block_size),
+            results(depth, 0),
+            done(depth, true),
+            stopped(false)
+        {
+            for (size_t i = 0; i < depth; i++) threads.emplace_back([this]{ run(); });
+        }
+
+        virtual ~thread_pool_io() {
+            std::unique_lock<std::mutex> guard(queue_mutex);
+            stopped = true;
+            guard.unlock();
+            queue_cv.notify_all();
+
+            for (auto& t : threads) t.join();
+        }
+
+        virtual char const* name() const override { return "thread pool"; }
+
+        virtual void submit_read(size_t slot, off_t offset, size_t len) override {
+            submit({slot, offset, len, false});
+        }
+
+        virtual void submit_write(size_t slot, off_t offset, size_t len) override {
+            submit({slot, offset, len, true});
+        }
+
+        virtual ssize_t wait(size_t slot) override {
+            std::unique_lock<std::mutex> guard(queue_mutex);
+            done_cv.wait(guard, [this, slot]{return bool(done[slot]);});
+            return results[slot];
+        }
+};
+
+inline std::unique_ptr<async_io> make_async_io(int fd, size_t depth, size_t block_size) {
+    std::unique_ptr<uring_io> uring(new uring_io(fd, depth, block_size));
+    if (uring->ok()) return uring;
+
+    return std::unique_ptr<async_io>(new thread_pool_io(fd, depth, block_size));
+}
+
+// Streams a file with depth reads in flight, wrapping around at EOF like
+// file_source. Slots are consumed in submission order, so the data comes
+// out in file order.
+class async_reader {
+    int fd;
+    size_t file_size;
+    size_t block_size;
+    std::unique_ptr<async_io> io;
+
+    std::vector<size_t> offsets;
+    std::vector<size_t> lengths;
+    size_t next_offset;
+    size_t head;
+    size_t read_idx;
+    ssize_t available;
+
+    void submit(size_t slot) {
+        size_t len = std::min(block_size, file_size - next_offset);
+        offsets[slot] = next_offset;
+        lengths[slot] = len;
+        io->submit_read(slot, next_offset, len);
+        next_offset += len;
+        if (next_offset == file_size) next_offset = 0;
+    }
+
+    public:
+        async_reader(char const* filename, size_t depth, size_t block_size) :
+            fd(open(filename, O_RDONLY)),
+            file_size(0),
+            block_size(block_size),
+            next_offset(0),
+            head(0),
+            read_idx(0),
+            available(-1)
+        {
+            if (fd < 0) {
+                perror(filename);
+                return;
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) == 0) file_size = st.st_size;
+            if (file_size == 0) return;
+
+            io = make_async_io(fd, depth, block_size);
+            offsets.resize(depth);
+            lengths.resize(depth);
+            for (size_t slot = 0; slot < depth; slot++) submit(slot);
+        }
+
+        ~async_reader() {
+            if (io) {
+                for (size_t slot = 0; slot < io->depth(); slot++) io->wait(slot);
+                io.reset();
+            }
+            if (fd >= 0) close(fd);
+        }
+
+        char const* backend() const { return io ? io->name() : "none"; }
+
+        size_t read(char* dst, size_t n) {
+            if (!io || io->failed()) return 0;
+
+            if (available < 0) {
+                available = io->wait(head);
+                read_idx = 0;
+                if (available < 0) {
+                    fprintf(stderr, "async read: %s\n", strerror(-available));
+                    available = 0;
+                    if (io->failed()) return 0;
+                }
+
+                // the later slots already cover the rest of the file, so a
+                // short read is finished here rather than left as a gap
+                while (static_cast<size_t>(available) < lengths[head]) {
+                    ssize_t res = pread(fd, io->buffer(head) + available, lengths[head] - available, offsets[head] + available);
+                    if (res < 0 && errno == EINTR) continue;
+                    if (res <= 0) break;
+                    available += res;
+                }
+            }
+
+            size_t count = std::min<size_t>(available - read_idx, n);
+            std::memcpy(dst, io->buffer(head) + read_idx, count);
+            read_idx += count;
+
+            if (read_idx == static_cast<size_t>(available)) {
+                submit(head);
+                head = (head + 1) % io->depth();
+                available = -1;
+            }
+
+            return count;
+        }
+};
+
+// Writes a file sequentially with up to depth block writes in flight. A slot
+// is only refilled once its previous write completed.
+class async_writer {
+    int fd;
+    size_t block_size;
+    std::unique_ptr<async_io> io;
+
+    std::vector<bool> in_flight;
+    size_t offset;
+    size_t head;
+    size_t write_idx;
+
+    void flush() {
+        io->submit_write(head, offset, write_idx);
+        in_flight[head] = true;
+        offset += write_idx;
+        head = (head + 1) % io->depth();
+        write_idx = 0;
+    }
+
+    void check(ssize_t res) {
+        if (res < 0) fprintf(stderr, "async write: %s\n", strerror(-res));
+    }
+
+    public:
+        async_writer(char const* filename, size_t depth, size_t block_size) :
+            fd(open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+            block_size(block_size),
+            in_flight(depth, false),
+            offset(0),
+            head(0),
+            write_idx(0)
+        {
+            if (fd < 0) {
+                perror(filename);
+                return;
+            }
+
+            io = make_async_io(fd, depth, block_size);
+        }
+
+        ~async_writer() {
+            if (io) {
+                if (write_idx > 0) flush();
+                for (size_t slot = 0; slot < io->depth(); slot++) {
+                    if (in_flight[slot]) check(io->wait(slot));
+                }
+                io.reset();
+            }
+            if (fd >= 0) close(fd);
+        }
+
+        char const* backend() const { return io ? io->name() : "none"; }
+
+        size_t write(char const* src, size_t n) {
+            if (!io) return n;
+
+            size_t total_count = 0;
+            while (total_count < n) {
+                if (in_flight[head]) {
+                    check(io->wait(head));
+                    if (io->failed()) return n;
+                    in_flight[head] = false;
+                }
+
+                size_t count = std::min(block_size - write_idx, n - total_count);
+                std::memcpy(io->buffer(head) + write_idx, src + total_count, count);
+                write_idx += count;
+                total_count += count;
+
+                if (write_idx == block_size) flush();
+            }
+
+            return n;
+        }
+};
+
+}
+
+#endif
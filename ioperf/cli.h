@@ -0,0 +1,230 @@
+#ifndef CLI_H
+#define CLI_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/program_options/parsers.hpp>
+
+#include "config.h"
+#include "transform.h"
+
+namespace ygg {
+
+namespace po = boost::program_options;
+
+// The names a hierarchy's factory understands, comma separated.
+struct cli_choices {
+    std::string hierarchy;
+    std::string pipes;
+    std::string sources;
+    std::string sinks;
+    std::string waits;
+    std::string compositions = "off";
+};
+
+inline std::string listing(std::string const& choices) {
+    std::string res;
+    for (auto const& choice : split(choices)) res += (res.empty() ? "" : ", ") + choice;
+    return res;
+}
+
+// Command line shared by ioperf and crtp_ioperf. run_pipeline is the
+// hierarchy's factory, called as run_pipeline(pipeline_config, bool print).
+//
+// Without --sweep every combination of --pipe, --wait, --sync-policy (for
+// the direct sink only), --dag, --compose, --dedup and --transform is run
+// once with the full sampling table; transforms listed after "none" are
+// also reported as a fraction of its consumer throughput. With --sweep the
+// grid of --sweep-capacities x --sweep-chunks x --sweep-threads is run for
+// every such combination, one summary line per point, and the matrix is
+// written to --sweep-output.
+template<typename RunPipeline>
+int run_cli(int argc, char* argv[], cli_choices const& choices, RunPipeline run_pipeline) {
+    pipeline_config config;
+    std::string pipes;
+    std::string waits;
+    std::string buffer_size;
+    std::string pipe_capacity;
+    std::string chunk_min;
+    std::string chunk_max;
+    std::string sync_policies;
+    std::string transforms;
+    std::string dedups;
+    std::string placements;
+    std::string pages;
+    std::string processes;
+    std::string compositions;
+    std::string dags;
+    std::string rates;
+    std::string arrivals;
+    std::string record_size;
+    std::string socket_buffer;
+    std::string datagram_size;
+    std::string block_size;
+    std::string sweep_capacities;
+    std::string sweep_chunks;
+    std::string sweep_threads;
+    std::string sweep_output;
+
+    // CLI
+    po::options_description desc("Supported options");
+    desc.add_options()
+        ("help", "produce help message")
+        ("input-file", po::value<std::string>(&config.input_file)->default_value("512k.dat"), "input file")
+        ("output-file", po::value<std::string>(&config.output_file)->default_value("out.dat"), "output file")
+        ("buffer-size", po::value<std::string>(&buffer_size)->default_value("256k"), "worker chunk size (initial size for the adaptive worker)")
+        ("chunk-min", po::value<std::string>(&chunk_min)->default_value("4k"), "smallest chunk size for the adaptive worker")
+        ("chunk-max", po::value<std::string>(&chunk_max)->default_value("4M"), "largest chunk size for the adaptive worker")
+        ("pipe-capacity", po::value<std::string>(&pipe_capacity)->default_value("1M"), "pipe capacity")
+        ("pipe", po::value<std::string>(&pipes)->default_value("all"), ("comma separated pipe types (" + listing(choices.pipes) + ", all)").c_str())
+        ("wait", po::value<std::string>(&waits)->default_value("default"), ("comma separated wait strategies for full/empty pipes (" + listing(choices.waits) + ")").c_str())
+        ("worker", po::value<std::string>(&config.worker)->default_value("fixed"), "worker type (fixed, direct, vector, adaptive; vector is virtual hierarchy only)")
+        ("source", po::value<std::string>(&config.source)->default_value("random"), ("source type (" + listing(choices.sources) + ")").c_str())
+        ("sink", po::value<std::string>(&config.sink)->default_value("null"), ("sink type (" + listing(choices.sinks) + ")").c_str())
+        ("rate", po::value<std::string>(&rates)->default_value("100M"), "comma separated offered loads in bytes a second for the paced source (e.g. 100M,200M,400M)")
+        ("arrival", po::value<std::string>(&arrivals)->default_value("constant"), "comma separated arrival processes for the paced source (constant, poisson)")
+        ("record-size", po::value<std::string>(&record_size)->default_value("4k"), "record size for the paced source")
+        ("seed", po::value<uint64_t>(&config.seed)->default_value(0), "seed for the prng source (0 picks a random one)")
+        ("queue-depth", po::value<size_t>(&config.queue_depth)->default_value(8), "I/O requests in flight for uring endpoints")
+        ("block-size", po::value<std::string>(&block_size)->default_value("1M"), "container block size for the block sink (0: one block per worker chunk)")
+        ("socket-buffer", po::value<std::string>(&socket_buffer)->default_value("0"), "SO_SNDBUF/SO_RCVBUF for socket endpoints (0: system default)")
+        ("socket-batch", po::value<size_t>(&config.socket_batch)->default_value(16), "datagrams per sendmmsg/recvmmsg call")
+        ("datagram-size", po::value<std::string>(&datagram_size)->default_value("16k"), "datagram size for unix-dgram and udp endpoints")
+        ("zerocopy", "send with MSG_ZEROCOPY where the socket supports it")
+        ("sync-policy", po::value<std::string>(&sync_policies)->default_value("never,bytes:8388608,us:1000"), "comma separated fdatasync policies for the direct sink (never, bytes:<N>, us:<T>)")
+        ("transform", po::value<std::string>(&transforms)->default_value("none"), "comma separated transform stages in front of the sink (none, crc32c, xxhash, xor, bswap16, bswap32, bswap64)")
+        ("dedup", po::value<std::string>(&dedups)->default_value("off"), "comma separated average chunk sizes for a content-defined dedup stage in front of the sink (off, e.g. 4k, 8k; virtual hierarchy only)")
+        ("isa", po::value<std::string>(&config.isa)->default_value("auto"), "highest instruction set for transform kernels (auto, scalar, sse4.2, avx2)")
+        ("placement", po::value<std::string>(&placements)->default_value("auto"), "comma separated worker layouts (none, auto, same-core, same-socket, cross-socket, or bench for the last three)")
+        ("cpus", po::value<std::string>(&config.cpus)->default_value(""), "explicit CPU list per worker, ':' separated (e.g. 0:1 or 0-3:4-7), overrides --placement")
+        ("mem-node", po::value<int>(&config.mem_node)->default_value(-1), "NUMA node to bind pipe and worker buffers to (-1: first touch by the pinned worker)")
+        ("pages", po::value<std::string>(&pages)->default_value("huge"), "comma separated page sizes for pipe and worker buffers (normal, thp, huge; huge falls back to thp)")
+        ("process", po::value<std::string>(&processes)->default_value("thread"), "comma separated process layouts (thread: all workers in this process, fork: consumers in a child process, shm pipe only)")
+        ("dag", po::value<std::string>(&dags)->default_value("none"), "comma separated pipeline graphs (none; tee, split, split-hash: one source, --consumers branches; merge, merge-ordered: --producers sources, one sink)")
+        ("compose", po::value<std::string>(&compositions)->default_value("off"), ("comma separated stage compositions, --transform stages joined by '+' (" + listing(choices.compositions) + "; fused: one thread, threaded: one per stage)").c_str())
+        ("producers", po::value<size_t>(&config.producers)->default_value(1), "workers feeding the pipe")
+        ("consumers", po::value<size_t>(&config.consumers)->default_value(1), "workers draining the pipe")
+        ("samples", po::value<size_t>(&config.sample_count)->default_value(10), "one second samples per run")
+        ("sweep", "run a parameter sweep instead of a single pipeline")
+        ("sweep-capacities", po::value<std::string>(&sweep_capacities)->default_value("64k,256k,1M,4M,16M"), "pipe capacities to sweep")
+        ("sweep-chunks", po::value<std::string>(&sweep_chunks)->default_value("4k,16k,64k,256k,1M"), "worker chunk sizes to sweep")
+        ("sweep-threads", po::value<std::string>(&sweep_threads)->default_value("1"), "producer/consumer thread counts to sweep")
+        ("sweep-output", po::value<std::string>(&sweep_output)->default_value("sweep.csv"), "sweep result file (.csv or .json)");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+
+    config.chunk_size = parse_size(buffer_size);
+    config.pipe_capacity = parse_size(pipe_capacity);
+    config.chunk_min = parse_size(chunk_min);
+    config.chunk_max = parse_size(chunk_max);
+    config.record_size = parse_size(record_size);
+    config.socket_buffer = parse_size(socket_buffer);
+    config.datagram_size = parse_size(datagram_size);
+    config.block_size = parse_size(block_size);
+    config.zerocopy = vm.count("zerocopy") > 0;
+
+    std::vector<std::string> wait_list;
+    for (auto const& wait : split(waits)) {
+        auto supported = split(choices.waits);
+        if (std::find(supported.begin(), supported.end(), wait) != supported.end()) wait_list.push_back(wait);
+        else printf("wait strategy %s: not supported by the %s pipes, skipped\n", wait.c_str(), choices.hierarchy.c_str());
+    }
+
+    std::vector<std::string> compose_list;
+    for (auto const& compose : split(compositions)) {
+        auto supported = split(choices.compositions);
+        if (std::find(supported.begin(), supported.end(), compose) != supported.end()) compose_list.push_back(compose);
+        else printf("composition %s: not supported by the %s hierarchy, skipped\n", compose.c_str(), choices.hierarchy.c_str());
+    }
+
+    std::vector<std::string> transform_list;
+    for (auto const& chain : split(transforms)) {
+        auto stages = split(chain, '+');
+        if (std::all_of(stages.begin(), stages.end(), [](std::string const& stage) { return transform::known(stage); })) transform_list.push_back(chain);
+        else printf("transform %s: unknown, skipped\n", chain.c_str());
+    }
+
+    auto pipe_list = split(pipes == "all" ? choices.pipes : pipes);
+    std::vector<pipeline_config> runs{config};
+    runs = expand(runs, &pipeline_config::pipe, pipe_list);
+    runs = expand(runs, &pipeline_config::wait, wait_list);
+    if (config.sink == "direct") runs = expand(runs, &pipeline_config::sync_policy, split(sync_policies));
+    runs = expand(runs, &pipeline_config::placement, split(placements == "bench" ? "same-core,same-socket,cross-socket" : placements));
+    runs = expand(runs, &pipeline_config::pages, split(pages));
+    runs = expand(runs, &pipeline_config::process, split(processes));
+    if (config.source == "paced") runs = expand(runs, &pipeline_config::rate, split(rates));
+    if (config.source == "paced") runs = expand(runs, &pipeline_config::arrival, split(arrivals));
+    runs = expand(runs, &pipeline_config::dag, split(dags));
+    runs = expand(runs, &pipeline_config::compose, compose_list);
+    runs = expand(runs, &pipeline_config::dedup, split(dedups));
+    runs = expand(runs, &pipeline_config::transform, transform_list);
+
+    // composed pipelines don't use the pipe type, so keep them once
+    runs.erase(std::remove_if(runs.begin(), runs.end(), [&](pipeline_config const& run) {
+        return run.compose != "off" && !pipe_list.empty() && run.pipe != pipe_list.front();
+    }), runs.end());
+
+    if (!vm.count("sweep")) {
+        size_t baseline = 0;
+        std::vector<pipeline_result> results;
+        for (auto const& run : runs) {
+            pipeline_result result = run_pipeline(run, true);
+            results.push_back(result);
+
+            // transforms vary fastest, so "none" precedes the rest of its group
+            if (run.transform == "none") baseline = result.consumer_rate;
+            else if (baseline > 0) printf("%s: %.1f%% of untransformed throughput\n", run.transform.c_str(), 100.0 * result.consumer_rate / baseline);
+        }
+
+        if (runs.size() > 1) {
+            bool paced = config.source == "paced";
+            printf("%-60s %14s %14s", "comparison", "producer KiB/s", "consumer KiB/s");
+            printf(paced ? " %10s %10s %10s\n" : "\n", "p50 ns", "p99 ns", "p99.9 ns");
+            for (size_t i = 0; i < runs.size(); i++) {
+                printf("%-60s %14zu %14zu", runs[i].name().c_str(), results[i].producer_rate, results[i].consumer_rate);
+                if (paced) printf(" %10lu %10lu %10lu", results[i].p50_ns, results[i].p99_ns, results[i].p999_ns);
+                printf("\n");
+            }
+        }
+        return 0;
+    }
+
+    // Sweep
+    std::vector<pipeline_config> configs;
+    std::vector<pipeline_result> results;
+    for (auto run : runs) {
+        run.sample_count = std::max<size_t>(run.sample_count, 2);
+
+        auto grid = sweep_grid(run, parse_sizes(sweep_capacities), parse_sizes(sweep_chunks), parse_sizes(sweep_threads));
+        for (auto const& point : grid) {
+            pipeline_result result = run_pipeline(point, false);
+            printf("%-40s capacity %9zu, chunk %9zu, threads %3zu: %9zu / %9zu KiB/s\n",
+                    point.name().c_str(), point.pipe_capacity, point.chunk_size, point.producers,
+                    result.producer_rate, result.consumer_rate);
+
+            configs.push_back(point);
+            results.push_back(result);
+        }
+    }
+
+    write_sweep(sweep_output, choices.hierarchy, configs, results);
+    printf("wrote %zu points to %s\n", configs.size(), sweep_output.c_str());
+
+    return 0;
+}
+
+}
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+
+namespace ygg {
+
+// Everything needed to build one pipeline at runtime. Shared by the
+// virtual (pipeline.h) and CRTP (crtp_pipeline.h) factories; each
+// factory documents which names it understands.
+struct pipeline_config {
+    std::string source = "random";
+    std::string pipe = "fixed";
+    std::string sink = "null";
+    std::string worker = "fixed";
+    std::string wait = "default";
+
+    std::string input_file = "512k.dat";
+    std::string output_file = "out.dat";
+
+    size_t pipe_capacity = 1*1024*1024;
+    size_t chunk_size = 1*256*1024;
+    size_t chunk_min = 4*1024;
+    size_t chunk_max = 4*1024*1024;
+    size_t producers = 1;
+    size_t consumers = 1;
+    size_t queue_depth = 8;
+    size_t block_size = 1*1024*1024; // of the block sink, 0: one block per put
+    std::string rate = "100M"; // bytes a second offered by the paced source
+    std::string arrival = "constant";
+    size_t record_size = 4*1024;
+    size_t socket_buffer = 0;
+    size_t socket_batch = 16;
+    size_t datagram_size = 16*1024;
+    bool zerocopy = false;
+    std::string sync_policy = "never";
+    std::string transform = "none";
+    std::string dedup = "off"; // average chunk size of a dedup stage in front of the sink (virtual only)
+    std::string isa = "auto";
+    uint64_t seed = 0;
+
+    std::string placement = "none";
+    std::string cpus;
+    int mem_node = -1;
+    std::string pages = "huge";
+    std::string process = "thread"; // "fork" runs the consumers in a child process
+    std::string dag = "none"; // tee, split, split-hash, merge or merge-ordered (virtual only)
+    std::string compose = "off"; // "fused" or "threaded" builds a composed pipeline (CRTP only)
+
+    size_t sample_count = 10;
+
+    std::string name() const {
+        std::string res = compose == "off" ? pipe + "_pipe" : compose;
+        if (wait != "default" && compose != "fused") res += "<" + wait + ">";
+        res += ", " + source + (source == "paced" ? " " + rate + "/s " + arrival : "") + " -> " + sink;
+        if (worker != "fixed") res += " (" + worker + ")";
+        if (transform != "none") res += " [" + transform + "]";
+        if (dedup != "off") res += " dedup:" + dedup;
+        if ((placement != "none" && placement != "auto") || !cpus.empty()) res += " @" + (cpus.empty() ? placement : cpus);
+        if (pages != "huge") res += " pages:" + pages;
+        if (process == "fork") res += " forked";
+        if (dag != "none") res += " " + dag;
+        if (producers > 1 || consumers > 1) res += " " + std::to_string(producers) + ":" + std::to_string(consumers);
+        return res;
+    }
+};
+
+// The latencies are only measured behind a paced source.
+struct pipeline_result {
+    size_t producer_rate;
+    size_t consumer_rate;
+    uint64_t p50_ns = 0;
+    uint64_t p99_ns = 0;
+    uint64_t p999_ns = 0;
+    double dedup_ratio = 0; // input per output byte of the dedup stage, 0 without one
+};
+
+// "64k", "1M", "2g" or plain bytes
+inline size_t parse_size(std::string const& str) {
+    size_t idx = 0;
+    size_t value = std::stoul(str, &idx);
+    if (idx < str.size()) {
+        switch (str[idx]) {
+            case 'k': case 'K': value <<= 10; break;
+            case 'm': case 'M': value <<= 20; break;
+            case 'g': case 'G': value <<= 30; break;
+        }
+    }
+    return value;
+}
+
+inline std::vector<std::string> split(std::string const& str, char sep = ',') {
+    std::vector<std::string> res;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, sep)) {
+        if (!item.empty()) res.push_back(item);
+    }
+    return res;
+}
+
+inline std::vector<size_t> parse_sizes(std::string const& str) {
+    std::vector<size_t> res;
+    for (auto const& item : split(str)) res.push_back(parse_size(item));
+    return res;
+}
+
+// Every config in configs once for each value of field.
+inline std::vector<pipeline_config> expand(std::vector<pipeline_config> const& configs,
+        std::string pipeline_config::* field, std::vector<std::string> const& values) {
+    std::vector<pipeline_config> res;
+    for (auto const& config : configs) {
+        for (auto const& value : values) {
+            res.push_back(config);
+            res.back().*field = value;
+        }
+    }
+    return res;
+}
+
+// Every combination of pipe capacity, chunk size and thread count on top of
+// base. A thread count of t runs t producers and t consumers.
+inline std::vector<pipeline_config> sweep_grid(pipeline_config const& base,
+        std::vector<size_t> const& capacities, std::vector<size_t> const& chunks, std::vector<size_t> const& threads) {
+    std::vector<pipeline_config> grid;
+    for (size_t capacity : capacities) {
+        for (size_t chunk : chunks) {
+            for (size_t t : threads) {
+                pipeline_config config = base;
+                config.pipe_capacity = capacity;
+                config.chunk_size = chunk;
+                config.producers = config.consumers = t;
+                grid.push_back(config);
+            }
+        }
+    }
+    return grid;
+}
+
+// Writes the throughput matrix as JSON if filename ends in .json, CSV
+// otherwise.
+inline void write_sweep(std::string const& filename, std::string const& hierarchy,
+        std::vector<pipeline_config> const& configs, std::vector<pipeline_result> const& results) {
+    std::ofstream ofs(filename);
+    bool json = filename.size() >= 5 && filename.compare(filename.size() - 5, 5, ".json") == 0;
+
+    if (json) {
+        ofs << "[\n";
+    } else {
+        ofs << "hierarchy,source,pipe,wait,sink,sync_policy,worker,transform,dedup,placement,pages,process,dag,compose,rate,arrival,pipe_capacity,chunk_size,producers,consumers,producer_kib_s,consumer_kib_s,p50_ns,p99_ns,p999_ns,dedup_ratio\n";
+    }
+
+    for (size_t i = 0; i < configs.size(); i++) {
+        auto const& c = configs[i];
+        auto const& r = results[i];
+
+        if (json) {
+            ofs << "  {\"hierarchy\": \"" << hierarchy << "\", \"source\": \"" << c.source
+                << "\", \"pipe\": \"" << c.pipe << "\", \"wait\": \"" << c.wait << "\", \"sink\": \"" << c.sink
+                << "\", \"sync_policy\": \"" << c.sync_policy << "\", \"worker\": \"" << c.worker << "\", \"transform\": \"" << c.transform << "\", \"dedup\": \"" << c.dedup
+                << "\", \"placement\": \"" << c.placement << "\", \"pages\": \"" << c.pages << "\", \"process\": \"" << c.process << "\", \"dag\": \"" << c.dag << "\", \"compose\": \"" << c.compose
+                << "\", \"rate\": \"" << c.rate << "\", \"arrival\": \"" << c.arrival << "\", \"pipe_capacity\": " << c.pipe_capacity
+                << ", \"chunk_size\": " << c.chunk_size << ", \"producers\": " << c.producers
+                << ", \"consumers\": " << c.consumers << ", \"producer_kib_s\": " << r.producer_rate
+                << ", \"consumer_kib_s\": " << r.consumer_rate << ", \"p50_ns\": " << r.p50_ns
+                << ", \"p99_ns\": " << r.p99_ns << ", \"p999_ns\": " << r.p999_ns << ", \"dedup_ratio\": " << r.dedup_ratio << "}" << (i + 1 < configs.size() ? "," : "") << "\n";
+        } else {
+            ofs << hierarchy << "," << c.source << "," << c.pipe << "," << c.wait << "," << c.sink << "," << c.sync_policy << "," << c.worker << "," << c.transform << "," << c.dedup << "," << c.placement << "," << c.pages << "," << c.process << "," << c.dag << "," << c.compose << "," << c.rate << "," << c.arrival << ","
+                << c.pipe_capacity << "," << c.chunk_size << "," << c.producers << "," << c.consumers << ","
+                << r.producer_rate << "," << r.consumer_rate << "," << r.p50_ns << "," << r.p99_ns << "," << r.p999_ns << "," << r.dedup_ratio << "\n";
+        }
+    }
+
+    if (json) ofs << "]\n";
+}
+
+}
+
+#endif
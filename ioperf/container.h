@@ -0,0 +1,284 @@
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "transform.h"
+
+namespace ygg {
+
+// The ioperf container format: a large input cut into checksummed blocks
+// with an index at the end, so that several readers can each take a range
+// of blocks and read them in parallel.
+//
+//   container_header   magic, version, nominal block size (0: variable)
+//   block_header       magic, payload length, sequence number, crc32c
+//   payload
+//   ...                one block_header and payload per block
+//   index_entry        offset, length and crc32c of every block, in order
+//   container_trailer  index offset, block count, magic
+//
+// Fields are written as the structs lie in memory, in native byte order,
+// so a container is only read back on a machine of the same endianness.
+// A file whose writer never got to write the index (no valid trailer) is
+// indexed by walking the block headers from the start, up to the first
+// block that doesn't check out.
+
+struct container_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+};
+
+struct block_header {
+    uint32_t magic;
+    uint32_t length;
+    uint64_t sequence;
+    uint32_t checksum;
+    uint32_t reserved;
+};
+
+struct index_entry {
+    uint64_t offset; // of the block_header
+    uint32_t length;
+    uint32_t checksum;
+};
+
+struct container_trailer {
+    uint64_t index_offset;
+    uint64_t block_count;
+    char magic[8];
+};
+
+static_assert(sizeof(container_header) == 16 && sizeof(block_header) == 24 &&
+        sizeof(index_entry) == 16 && sizeof(container_trailer) == 24, "container layout");
+
+constexpr char container_magic[8] = {'Y', 'G', 'G', 'B', 'L', 'K', 'S', '1'};
+constexpr char trailer_magic[8] = {'Y', 'G', 'G', 'I', 'N', 'D', 'X', '1'};
+constexpr uint32_t block_magic = 0x6b6c6279; // "yblk"
+constexpr uint32_t container_version = 1;
+constexpr size_t max_block_size = 1u << 30;
+
+// CRC32C of a block's payload, with SSE4.2 where the CPU has it
+inline uint32_t block_checksum(char const* data, size_t n) {
+    static bool const sse42 = detect_isa() != isa::scalar;
+    return ~(sse42 ? crc32c_sse42(0xffffffff, data, n) : crc32c_scalar(0xffffffff, data, n));
+}
+
+// pread/pwrite until done, false on error or EOF
+inline bool pread_all(int fd, void* dst, size_t n, off_t offset) {
+    char* p = static_cast<char*>(dst);
+    while (n > 0) {
+        ssize_t count = pread(fd, p, n, offset);
+        if (count <= 0) return false;
+        p += count;
+        n -= count;
+        offset += count;
+    }
+    return true;
+}
+
+inline bool pwrite_all(int fd, void const* src, size_t n, off_t offset) {
+    char const* p = static_cast<char const*>(src);
+    while (n > 0) {
+        ssize_t count = pwrite(fd, p, n, offset);
+        if (count <= 0) return false;
+        p += count;
+        n -= count;
+        offset += count;
+    }
+    return true;
+}
+
+// The block index of an open container. Reads go through pread only, so
+// one reader can be shared between threads as long as each reads into its
+// own buffer.
+class container_reader {
+    int fd;
+    uint32_t nominal_block_size;
+    std::vector<index_entry> index;
+    bool scanned;
+
+    bool load_index(off_t file_size) {
+        container_trailer trailer;
+        if (file_size < static_cast<off_t>(sizeof(container_header) + sizeof(trailer))) return false;
+        if (!pread_all(fd, &trailer, sizeof(trailer), file_size - sizeof(trailer))) return false;
+        if (std::memcmp(trailer.magic, trailer_magic, sizeof(trailer_magic)) != 0) return false;
+
+        if (trailer.block_count > static_cast<uint64_t>(file_size) / sizeof(index_entry)) return false;
+        uint64_t index_bytes = trailer.block_count * sizeof(index_entry);
+        if (trailer.index_offset + index_bytes + sizeof(trailer) != static_cast<uint64_t>(file_size)) return false;
+
+        index.resize(trailer.block_count);
+        return pread_all(fd, index.data(), index_bytes, trailer.index_offset);
+    }
+
+    // Header by header from the start; the payload checksums are left to
+    // read(), so this costs one small pread per block.
+    void scan_index(off_t file_size) {
+        index.clear();
+        uint64_t offset = sizeof(container_header);
+        block_header header;
+        while (offset + sizeof(header) <= static_cast<uint64_t>(file_size) && pread_all(fd, &header, sizeof(header), offset)) {
+            if (header.magic != block_magic || header.sequence != index.size() || header.length > max_block_size) break;
+            if (offset + sizeof(header) + header.length > static_cast<uint64_t>(file_size)) break;
+            index.push_back({offset, header.length, header.checksum});
+            offset += sizeof(header) + header.length;
+        }
+        scanned = true;
+    }
+
+    public:
+        container_reader(char const* filename) :
+            fd(open(filename, O_RDONLY)),
+            nominal_block_size(0),
+            scanned(false)
+        {
+            if (fd < 0) {
+                perror(filename);
+                return;
+            }
+
+            container_header header;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || !pread_all(fd, &header, sizeof(header), 0) ||
+                    std::memcmp(header.magic, container_magic, sizeof(container_magic)) != 0 || header.version != container_version) {
+                fprintf(stderr, "%s: not an ioperf container\n", filename);
+                close(fd);
+                fd = -1;
+                return;
+            }
+
+            nominal_block_size = header.block_size;
+            if (!load_index(st.st_size)) scan_index(st.st_size);
+        }
+
+        ~container_reader() {
+            if (fd >= 0) close(fd);
+        }
+
+        container_reader(container_reader const&) = delete;
+        container_reader& operator=(container_reader const&) = delete;
+
+        bool valid() const { return fd >= 0; }
+        size_t blocks() const { return index.size(); }
+        uint32_t block_size() const { return nominal_block_size; }
+        bool recovered() const { return scanned; }
+        size_t length(size_t block) const { return index[block].length; }
+
+        size_t max_length() const {
+            size_t res = 0;
+            for (auto const& e : index) res = std::max<size_t>(res, e.length);
+            return res;
+        }
+
+        // Reads the header and payload of a block in one preadv and checks
+        // both against the index. Returns the payload length, or -1 if the
+        // block is damaged; dst must hold length(block) bytes.
+        ssize_t read(size_t block, char* dst) const {
+            index_entry const& e = index[block];
+            block_header header;
+            iovec iov[2] = {{&header, sizeof(header)}, {dst, e.length}};
+
+            ssize_t count = preadv(fd, iov, 2, e.offset);
+            if (count != static_cast<ssize_t>(sizeof(header) + e.length)) return -1;
+            if (header.magic != block_magic || header.sequence != block || header.length != e.length || header.checksum != e.checksum) return -1;
+            if (block_checksum(dst, e.length) != e.checksum) return -1;
+            return e.length;
+        }
+};
+
+// Appends blocks to a new container and writes the index and trailer on
+// finish() or destruction. Blocks go out as one writev of header and
+// payload, straight from the caller's buffer.
+class container_writer {
+    int fd;
+    uint64_t offset;
+    std::vector<index_entry> index;
+    bool finished;
+
+    public:
+        container_writer(char const* filename, uint32_t block_size) :
+            fd(open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+            offset(sizeof(container_header)),
+            finished(false)
+        {
+            if (fd < 0) {
+                perror(filename);
+                return;
+            }
+
+            container_header header{{}, container_version, block_size};
+            std::memcpy(header.magic, container_magic, sizeof(container_magic));
+            if (!pwrite_all(fd, &header, sizeof(header), 0)) perror(filename);
+        }
+
+        ~container_writer() {
+            finish();
+            if (fd >= 0) close(fd);
+        }
+
+        container_writer(container_writer const&) = delete;
+        container_writer& operator=(container_writer const&) = delete;
+
+        size_t blocks() const { return index.size(); }
+        uint64_t bytes() const { return offset; }
+
+        // n must not exceed max_block_size
+        bool append(char const* data, size_t n) {
+            if (fd < 0 || finished) return false;
+
+            uint32_t checksum = block_checksum(data, n);
+            block_header header{block_magic, static_cast<uint32_t>(n), index.size(), checksum, 0};
+            iovec iov[2] = {{&header, sizeof(header)}, {const_cast<char*>(data), n}};
+
+            size_t total = sizeof(header) + n;
+            ssize_t count = pwritev(fd, iov, 2, offset);
+            size_t done = count > 0 ? count : 0;
+
+            // whatever the kernel didn't take goes out in plain pwrites
+            if (done < sizeof(header)) {
+                if (!pwrite_all(fd, reinterpret_cast<char*>(&header) + done, sizeof(header) - done, offset + done)) {
+                    perror("container block");
+                    return false;
+                }
+                done = sizeof(header);
+            }
+            if (done < total && !pwrite_all(fd, data + (done - sizeof(header)), total - done, offset + done)) {
+                perror("container block");
+                return false;
+            }
+
+            index.push_back({offset, static_cast<uint32_t>(n), checksum});
+            offset += total;
+            return true;
+        }
+
+        void finish() {
+            if (fd < 0 || finished) return;
+            finished = true;
+
+            container_trailer trailer{offset, index.size(), {}};
+            std::memcpy(trailer.magic, trailer_magic, sizeof(trailer_magic));
+            if (!pwrite_all(fd, index.data(), index.size() * sizeof(index_entry), offset) ||
+                    !pwrite_all(fd, &trailer, sizeof(trailer), offset + index.size() * sizeof(index_entry))) {
+                perror("container index");
+            }
+            offset += index.size() * sizeof(index_entry) + sizeof(trailer);
+        }
+};
+
+}
+
+#endif
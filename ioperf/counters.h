@@ -0,0 +1,127 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace ygg {
+
+// What one thread spent between the construction of its thread_counters
+// and read(). The hardware fields are only meaningful if hardware is set.
+struct counter_values {
+    bool hardware = false;
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t cache_misses = 0;
+    uint64_t dtlb_misses = 0;
+    uint64_t context_switches = 0;
+    uint64_t cpu_ns = 0;
+};
+
+// Counts for the calling thread only. Hardware counters come from
+// perf_event_open and are limited to user space so they work at
+// perf_event_paranoid 2; if the kernel or the VM won't give us a PMU we
+// still report CPU time and context switches from the clock and getrusage.
+class thread_counters {
+    enum { cycles, instructions, cache_misses, dtlb_misses, event_count };
+
+    int fds[event_count];
+    uint64_t start_cpu_ns;
+    uint64_t start_switches;
+
+    static int open_event(uint32_t type, uint64_t config) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    // scaled up if the PMU was multiplexed between more events than it has
+    static uint64_t read_event(int fd) {
+        uint64_t v[3];
+        if (::read(fd, v, sizeof(v)) != sizeof(v) || v[2] == 0) return 0;
+        return v[2] < v[1] ? static_cast<uint64_t>(static_cast<double>(v[0]) * v[1] / v[2]) : v[0];
+    }
+
+    static uint64_t cpu_time_ns() {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+
+    static uint64_t switches() {
+        rusage ru;
+        getrusage(RUSAGE_THREAD, &ru);
+        return ru.ru_nvcsw + ru.ru_nivcsw;
+    }
+
+    public:
+        thread_counters() {
+            fds[cycles] = open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+            fds[instructions] = fds[cycles] >= 0 ? open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS) : -1;
+            fds[cache_misses] = fds[cycles] >= 0 ? open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES) : -1;
+            fds[dtlb_misses] = fds[cycles] >= 0 ? open_event(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+                    | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)) : -1;
+
+            start_cpu_ns = cpu_time_ns();
+            start_switches = switches();
+        }
+
+        ~thread_counters() {
+            for (int fd : fds) if (fd >= 0) close(fd);
+        }
+
+        thread_counters(thread_counters const&) = delete;
+        thread_counters& operator=(thread_counters const&) = delete;
+
+        // must be called on the thread that constructed this
+        counter_values read() const {
+            counter_values res;
+            res.cpu_ns = cpu_time_ns() - start_cpu_ns;
+            res.context_switches = switches() - start_switches;
+
+            if (fds[cycles] >= 0 && fds[instructions] >= 0) {
+                res.hardware = true;
+                res.cycles = read_event(fds[cycles]);
+                res.instructions = read_event(fds[instructions]);
+                if (fds[cache_misses] >= 0) res.cache_misses = read_event(fds[cache_misses]);
+                if (fds[dtlb_misses] >= 0) res.dtlb_misses = read_event(fds[dtlb_misses]);
+            }
+            return res;
+        }
+};
+
+// One line per worker: CPU time, context switches and, with hardware
+// counters, IPC, cache and dTLB load misses and bytes moved per cycle.
+inline void print_counters(std::vector<counter_values> const& counters, std::vector<uint64_t> const& bytes) {
+    printf("%-4s %10s %9s %14s %6s %12s %12s %10s\n", "", "cpu ms", "ctx sw", "cycles", "IPC", "cache miss", "dTLB miss", "B/cycle");
+    for (size_t w = 0; w < counters.size(); w++) {
+        counter_values const& c = counters[w];
+        printf("%-4s %10.1f %9lu", ("w" + std::to_string(w + 1)).c_str(), c.cpu_ns / 1e6, c.context_switches);
+        if (c.hardware && c.cycles > 0) {
+            printf(" %14lu %6.2f %12lu %12lu %10.3f\n", c.cycles, static_cast<double>(c.instructions) / c.cycles,
+                    c.cache_misses, c.dtlb_misses, static_cast<double>(bytes[w]) / c.cycles);
+        } else {
+            printf(" %14s %6s %12s %12s %10s\n", "n/a", "n/a", "n/a", "n/a", "n/a");
+        }
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef CRTP_COMPOSE_H
+#define CRTP_COMPOSE_H
+
+#include <memory>
+#include <vector>
+#include <utility>
+
+#include "sampling.h"
+#include "transform.h"
+#include "crtp_source.h"
+#include "crtp_worker.h"
+
+namespace ygg {
+
+// Pipelines written as a chain of CRTP stages, in the spirit of the
+// pipeables in gen/test-generator.cpp:
+//
+//   auto workers = compose<WordType>(src, chunk_size)
+//                | through(xor_stage)
+//                | async_stage(pipe)
+//                | through(crc_stage)
+//                | into(dst);
+//
+// Stages between two boundaries are fused: every through() wraps the
+// source so far in a transformed_source, so the chain up to a boundary is
+// one statically typed get() that a single fixed_worker calls once per
+// chunk, and each chunk passes through all of those stages while it is
+// still in cache. Only async_stage() adds a thread: the chain so far fills
+// the pipe on its own worker and the stages after it read from the pipe.
+// into() ends the chain with the list of workers to run, source side first.
+
+// Runs everything Upstream produces through a transform.
+template<typename WordType, typename Upstream>
+class transformed_source : public source<WordType, transformed_source<WordType, Upstream>> {
+    std::shared_ptr<Upstream> src;
+    std::shared_ptr<transform> stage;
+
+    public:
+        transformed_source(std::shared_ptr<Upstream> src, std::shared_ptr<transform> stage) :
+            src(src),
+            stage(stage) {}
+
+        size_t get(WordType* dst, size_t n) {
+            size_t count = src->get(dst, n);
+            stage->apply(reinterpret_cast<char*>(dst), count * sizeof(WordType));
+            return count;
+        }
+
+        void stop() { src->stop(); }
+};
+
+// A chain that hasn't reached its sink yet: the fused source of the
+// current segment and the workers of the segments before it.
+template<typename WordType, typename SourceType>
+struct composition {
+    std::shared_ptr<SourceType> src;
+    size_t chunk_size;
+    std::vector<std::shared_ptr<worker>> workers;
+};
+
+struct transform_step {
+    std::shared_ptr<transform> stage;
+};
+
+template<typename PipeType>
+struct async_step {
+    std::shared_ptr<PipeType> pipe;
+};
+
+template<typename SinkType>
+struct sink_step {
+    std::shared_ptr<SinkType> dst;
+};
+
+// chunk_size is in words, as for the workers
+template<typename WordType, typename SourceType>
+composition<WordType, SourceType> compose(std::shared_ptr<SourceType> src, size_t chunk_size) {
+    return {src, chunk_size, {}};
+}
+
+inline transform_step through(std::shared_ptr<transform> stage) { return {stage}; }
+
+template<typename PipeType>
+async_step<PipeType> async_stage(std::shared_ptr<PipeType> pipe) { return {pipe}; }
+
+template<typename SinkType>
+sink_step<SinkType> into(std::shared_ptr<SinkType> dst) { return {dst}; }
+
+template<typename WordType, typename SourceType>
+composition<WordType, transformed_source<WordType, SourceType>> operator|(composition<WordType, SourceType> chain, transform_step step) {
+    return {std::make_shared<transformed_source<WordType, SourceType>>(chain.src, step.stage), chain.chunk_size, std::move(chain.workers)};
+}
+
+template<typename WordType, typename SourceType, typename PipeType>
+composition<WordType, PipeType> operator|(composition<WordType, SourceType> chain, async_step<PipeType> step) {
+    chain.workers.push_back(make_aligned<fixed_worker<WordType, SourceType, PipeType>>(chain.src, step.pipe, chain.chunk_size));
+    return {step.pipe, chain.chunk_size, std::move(chain.workers)};
+}
+
+template<typename WordType, typename SourceType, typename SinkType>
+std::vector<std::shared_ptr<worker>> operator|(composition<WordType, SourceType> chain, sink_step<SinkType> step) {
+    chain.workers.push_back(make_aligned<fixed_worker<WordType, SourceType, SinkType>>(chain.src, step.dst, chain.chunk_size));
+    return std::move(chain.workers);
+}
+
+}
+
+#endif
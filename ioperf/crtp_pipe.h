@@ -4,64 +4,267 @@
 #include <mutex>
 #include <condition_variable>
 #include <algorithm>
-#include <array>
+#include <atomic>
+#include <memory>
+#include <thread>
 
+#include "util.h"
+#include "arena.h"
+#include "histogram.h"
 #include "crtp_source.h"
 #include "crtp_sink.h"
 
 namespace ygg {
 
+// Pipes also offer in-place access to their buffer through
+// reserve()/commit() and peek()/consume(), see pipe in pipe.h.
 template<typename WordType, typename Derived>
 class pipe : public source<WordType, Derived>, public sink<WordType, Derived> {};
 
 template<typename WordType, size_t Capacity>
 class fixed_pipe : public pipe<WordType, fixed_pipe<WordType, Capacity>> {
-    std::array<WordType, Capacity> buf;
+    arena_buffer<WordType> buf;
     size_t write_idx;
     size_t read_idx;
+    bool reserved;
     bool stopped;
 
+    // producers and consumers wait on the same cv, so a single wakeup could
+    // go to a thread waiting for the other condition; see block_wait
     std::condition_variable cv;
     std::mutex buf_mutex;
 
+    latency_probe put_latency;
+    latency_probe get_latency;
+    latency_probe full_wait;
+    latency_probe empty_wait;
+
     public:
         fixed_pipe() :
+            buf(Capacity),
             write_idx(0),
             read_idx(0),
-            stopped(false) {}
+            reserved(false),
+            stopped(false),
+            put_latency("fixed_pipe put"),
+            get_latency("fixed_pipe get"),
+            full_wait("fixed_pipe full wait"),
+            empty_wait("fixed_pipe empty wait") {}
 
         size_t put(WordType* src, size_t n) {
+            scoped_latency t(put_latency);
             std::unique_lock<std::mutex> guard(buf_mutex);
-            cv.wait(guard, [this]{return (this->write_idx < Capacity) || stopped;});
+            timed_wait(cv, guard, full_wait, [this]{return (this->write_idx < Capacity) || stopped;});
 
             size_t count = std::min(Capacity - write_idx, n);
             std::copy(src, src + count, buf.data() + write_idx);
             write_idx += count;
 
             guard.unlock();
-            cv.notify_one();
+            cv.notify_all();
 
             return count;
         }
 
         size_t get(WordType* dst, size_t n) {
+            scoped_latency t(get_latency);
             std::unique_lock<std::mutex> guard(buf_mutex);
-            cv.wait(guard, [this]{return (this->read_idx < this->write_idx) || stopped;});
+            timed_wait(cv, guard, empty_wait, [this]{return (this->read_idx < this->write_idx) || stopped;});
 
             size_t count = std::min(write_idx - read_idx, n);
             std::copy(buf.data() + read_idx, buf.data() + read_idx + count, dst);
             read_idx += count;
+            if (read_idx == write_idx && !reserved) read_idx = write_idx = 0;
+
+            guard.unlock();
+            cv.notify_all();
+
+            return count;
+        }
+
+        span<WordType> reserve(size_t n) {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            timed_wait(cv, guard, full_wait, [this]{return (this->write_idx < Capacity) || stopped;});
+
+            reserved = true;
+            return {buf.data() + write_idx, std::min(Capacity - write_idx, n)};
+        }
+
+        void commit(size_t n) {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            write_idx += n;
+            reserved = false;
             if (read_idx == write_idx) read_idx = write_idx = 0;
 
             guard.unlock();
-            cv.notify_one();
+            cv.notify_all();
+        }
+
+        span<WordType> peek() {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            timed_wait(cv, guard, empty_wait, [this]{return (this->read_idx < this->write_idx) || stopped;});
+
+            return {buf.data() + read_idx, write_idx - read_idx};
+        }
+
+        void consume(size_t n) {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            read_idx += n;
+            if (read_idx == write_idx && !reserved) read_idx = write_idx = 0;
+
+            guard.unlock();
+            cv.notify_all();
+        }
+
+        void stop() {
+            {
+                std::lock_guard<std::mutex> guard(buf_mutex);
+                stopped = true;
+            }
+            cv.notify_all();
+        }
+};
+
+// Lock-free single-producer/single-consumer ring, see spsc_pipe in pipe.h.
+template<typename WordType>
+class spsc_pipe : public pipe<WordType, spsc_pipe<WordType>> {
+    arena_buffer<WordType> buf;
+    size_t capacity;
+    size_t mask;
+
+    // producer-owned
+    alignas(cache_line_size) std::atomic<size_t> write_idx;
+    size_t cached_read_idx;
+
+    // consumer-owned
+    alignas(cache_line_size) std::atomic<size_t> read_idx;
+    size_t cached_write_idx;
+
+    alignas(cache_line_size) std::atomic<bool> stopped;
+
+    latency_probe put_latency;
+    latency_probe get_latency;
+    latency_probe full_wait;
+    latency_probe empty_wait;
+
+    public:
+        spsc_pipe(size_t capacity) :
+            buf(next_pow2(capacity)),
+            capacity(next_pow2(capacity)),
+            mask(next_pow2(capacity) - 1),
+            write_idx(0),
+            cached_read_idx(0),
+            read_idx(0),
+            cached_write_idx(0),
+            stopped(false),
+            put_latency("spsc_pipe put"),
+            get_latency("spsc_pipe get"),
+            full_wait("spsc_pipe full wait"),
+            empty_wait("spsc_pipe empty wait") {}
+
+        size_t put(WordType* src, size_t n) {
+            scoped_latency t(put_latency);
+            size_t w = write_idx.load(std::memory_order_relaxed);
+
+            if (capacity - (w - cached_read_idx) < n) {
+                cached_read_idx = read_idx.load(std::memory_order_acquire);
+            }
+            if (w - cached_read_idx == capacity) {
+                scoped_latency t(full_wait);
+                while (w - cached_read_idx == capacity) {
+                    if (stopped.load(std::memory_order_relaxed)) return 0;
+                    std::this_thread::yield();
+                    cached_read_idx = read_idx.load(std::memory_order_acquire);
+                }
+            }
+
+            size_t count = std::min(capacity - (w - cached_read_idx), n);
+            size_t offset = w & mask;
+            size_t first = std::min(count, capacity - offset);
+            std::copy(src, src + first, buf.data() + offset);
+            std::copy(src + first, src + count, buf.data());
+
+            write_idx.store(w + count, std::memory_order_release);
 
             return count;
         }
 
+        size_t get(WordType* dst, size_t n) {
+            scoped_latency t(get_latency);
+            size_t r = read_idx.load(std::memory_order_relaxed);
+
+            if (cached_write_idx - r < n) {
+                cached_write_idx = write_idx.load(std::memory_order_acquire);
+            }
+            if (cached_write_idx == r) {
+                scoped_latency t(empty_wait);
+                while (cached_write_idx == r) {
+                    if (stopped.load(std::memory_order_relaxed)) return 0;
+                    std::this_thread::yield();
+                    cached_write_idx = write_idx.load(std::memory_order_acquire);
+                }
+            }
+
+            size_t count = std::min(cached_write_idx - r, n);
+            size_t offset = r & mask;
+            size_t first = std::min(count, capacity - offset);
+            std::copy(buf.data() + offset, buf.data() + offset + first, dst);
+            std::copy(buf.data(), buf.data() + count - first, dst + first);
+
+            read_idx.store(r + count, std::memory_order_release);
+
+            return count;
+        }
+
+        span<WordType> reserve(size_t n) {
+            size_t w = write_idx.load(std::memory_order_relaxed);
+
+            if (w - cached_read_idx == capacity) {
+                cached_read_idx = read_idx.load(std::memory_order_acquire);
+            }
+            if (w - cached_read_idx == capacity) {
+                scoped_latency t(full_wait);
+                while (w - cached_read_idx == capacity) {
+                    if (stopped.load(std::memory_order_relaxed)) return {buf.data(), 0};
+                    std::this_thread::yield();
+                    cached_read_idx = read_idx.load(std::memory_order_acquire);
+                }
+            }
+
+            size_t offset = w & mask;
+            size_t count = std::min(capacity - (w - cached_read_idx), capacity - offset);
+            return {buf.data() + offset, std::min(count, n)};
+        }
+
+        void commit(size_t n) {
+            write_idx.store(write_idx.load(std::memory_order_relaxed) + n, std::memory_order_release);
+        }
+
+        span<WordType> peek() {
+            size_t r = read_idx.load(std::memory_order_relaxed);
+
+            if (cached_write_idx == r) {
+                cached_write_idx = write_idx.load(std::memory_order_acquire);
+            }
+            if (cached_write_idx == r) {
+                scoped_latency t(empty_wait);
+                while (cached_write_idx == r) {
+                    if (stopped.load(std::memory_order_relaxed)) return {buf.data(), 0};
+                    std::this_thread::yield();
+                    cached_write_idx = write_idx.load(std::memory_order_acquire);
+                }
+            }
+
+            size_t offset = r & mask;
+            return {buf.data() + offset, std::min(cached_write_idx - r, capacity - offset)};
+        }
+
+        void consume(size_t n) {
+            read_idx.store(read_idx.load(std::memory_order_relaxed) + n, std::memory_order_release);
+        }
+
         void stop() {
             stopped = true;
-            cv.notify_all();
         }
 };
 
@@ -0,0 +1,316 @@
+#ifndef CRTP_PIPELINE_H
+#define CRTP_PIPELINE_H
+
+#include <cstdio>
+#include <memory>
+#include <vector>
+#include <string>
+
+#include "config.h"
+#include "sampling.h"
+#include "util.h"
+#include "crtp_source.h"
+#include "crtp_sink.h"
+#include "crtp_pipe.h"
+#include "crtp_worker.h"
+#include "crtp_compose.h"
+#include "topology.h"
+#include "arena.h"
+
+namespace ygg {
+
+// Runtime factory for the CRTP hierarchy: each runtime choice selects a
+// template instantiation, so the resulting pipeline is fully statically
+// typed. Sizes in the config are in bytes.
+//
+//   source: random, prng, file, mmap, uring
+//   pipe:   fixed, spsc
+//   sink:   null, file, mmap, uring
+//   worker: fixed, direct, adaptive
+//
+// Any transform other than none wraps the sink in a transform_sink.
+// With compose "fused" or "threaded" the pipe and worker are ignored and
+// the pipeline is built with crtp_compose.h instead, see run_composed.
+// fixed_pipe capacities are rounded up to a power of two between 64 KiB and
+// 64 MiB. Only fixed_pipe supports more than one worker per side.
+
+// Calls f with a factory for the configured source type.
+template<typename WordType, typename F>
+void with_source(pipeline_config const& config, F&& f) {
+    char const* filename = config.input_file.c_str();
+    size_t queue_depth = config.queue_depth;
+
+    if (config.source == "file") f([=]{ return std::make_shared<file_source<WordType>>(filename); });
+    else if (config.source == "mmap") f([=]{ return std::make_shared<mmap_file_source<WordType>>(filename); });
+    else if (config.source == "uring") f([=]{ return std::make_shared<uring_file_source<WordType>>(filename, queue_depth); });
+    else if (config.source == "prng") {
+        // one seed per producer, see make_source in pipeline.h
+        auto seed = std::make_shared<uint64_t>(config.seed);
+        f([=]{ return make_aligned<random_source<WordType>>(*seed ? (*seed)++ : 0); });
+    }
+    else f([]{ return std::make_shared<random_buf_source<WordType, 1*1024*1204>>(); });
+}
+
+// Every sink after the first writes to output_file.i, see make_sink in
+// pipeline.h.
+template<typename WordType, typename F>
+void with_plain_sink(pipeline_config const& config, F&& f) {
+    std::string output_file = config.output_file;
+    size_t queue_depth = config.queue_depth;
+    auto index = std::make_shared<size_t>(0);
+    auto filename = [=]{
+        size_t i = (*index)++;
+        return i ? output_file + "." + std::to_string(i) : output_file;
+    };
+
+    if (config.sink == "file") f([=]{ return std::make_shared<file_sink<WordType>>(filename().c_str()); });
+    else if (config.sink == "mmap") f([=]{ return std::make_shared<mmap_file_sink<WordType>>(filename().c_str()); });
+    else if (config.sink == "uring") f([=]{ return std::make_shared<uring_file_sink<WordType>>(filename().c_str(), queue_depth); });
+    else f([]{ return std::make_shared<null_sink<WordType>>(); });
+}
+
+template<typename WordType, typename F>
+void with_sink(pipeline_config const& config, F&& f) {
+    if (config.transform == "none") {
+        with_plain_sink<WordType>(config, f);
+        return;
+    }
+
+    transform stage(config.transform, config.isa);
+    with_plain_sink<WordType>(config, [&](auto make_dst) {
+        using SinkType = typename decltype(make_dst())::element_type;
+        f([=]{ return std::make_shared<transform_sink<WordType, SinkType>>(make_dst(), stage); });
+    });
+}
+
+template<typename SinkType>
+void print_transform(std::shared_ptr<SinkType> const&, size_t) {}
+
+template<typename WordType, typename SinkType>
+void print_transform(std::shared_ptr<transform_sink<WordType, SinkType>> const& dst, size_t w) {
+    if (dst->transform().checksum()) {
+        printf("%s: %#018lx over %lu bytes (w%zu)\n", dst->transform().name().c_str(),
+                dst->transform().digest(), dst->transform().bytes(), w);
+    } else {
+        printf("%s\n", dst->transform().name().c_str());
+    }
+}
+
+// Which async I/O backend a uring source or sink ended up with, and which
+// kernel a prng source runs
+template<typename EndpointType>
+void print_backend(std::shared_ptr<EndpointType> const&) {}
+
+template<typename WordType>
+void print_backend(std::shared_ptr<uring_file_source<WordType>> const& src) {
+    printf("uring source: %s\n", src->backend());
+}
+
+template<typename WordType>
+void print_backend(std::shared_ptr<random_source<WordType>> const& src) {
+    printf("prng (%s)\n", isa_name(src->kernel()));
+}
+
+template<typename WordType>
+void print_backend(std::shared_ptr<uring_file_sink<WordType>> const& dst) {
+    printf("uring sink: %s\n", dst->backend());
+}
+
+template<typename WordType, typename SinkType>
+void print_backend(std::shared_ptr<transform_sink<WordType, SinkType>> const& dst) {
+    print_backend(dst->next());
+}
+
+template<typename WordType, typename F>
+void with_pipe(pipeline_config const& config, F&& f) {
+    size_t capacity = config.pipe_capacity / sizeof(WordType);
+
+    if (config.pipe == "spsc") {
+        f(make_aligned<spsc_pipe<WordType>>(capacity));
+    } else {
+        pow2_dispatch<64*1024, 64*1024*1024>::call(capacity, [&](auto cap) {
+            f(make_aligned<fixed_pipe<WordType, decltype(cap)::value>>());
+        });
+    }
+}
+
+// The most transforms a composed pipeline chains; every extra one is
+// another set of instantiations per source and sink.
+constexpr size_t max_composed_stages = 3;
+
+// An spsc_pipe boundary in a threaded composition, nothing in a fused one.
+template<typename WordType, typename Chain>
+Chain stage_boundary(Chain chain, size_t, std::false_type) { return chain; }
+
+template<typename WordType, typename SourceType>
+composition<WordType, spsc_pipe<WordType>> stage_boundary(composition<WordType, SourceType> chain, size_t capacity, std::true_type) {
+    return chain | async_stage(make_aligned<spsc_pipe<WordType>>(capacity));
+}
+
+// Appends stages[i..] to chain and ends it in dst, with a boundary in front
+// of every transform and of the sink.
+template<typename WordType, bool Threaded, typename Chain, typename SinkType>
+std::vector<std::shared_ptr<worker>> close_chain(Chain chain, std::vector<std::shared_ptr<transform>> const&,
+        size_t, size_t capacity, std::shared_ptr<SinkType> dst, std::integral_constant<size_t, 0>) {
+    return stage_boundary<WordType>(chain, capacity, std::integral_constant<bool, Threaded>()) | into(dst);
+}
+
+template<typename WordType, bool Threaded, typename Chain, typename SinkType, size_t Depth>
+std::vector<std::shared_ptr<worker>> close_chain(Chain chain, std::vector<std::shared_ptr<transform>> const& stages,
+        size_t i, size_t capacity, std::shared_ptr<SinkType> dst, std::integral_constant<size_t, Depth>) {
+    if (i == stages.size()) return close_chain<WordType, Threaded>(chain, stages, i, capacity, dst, std::integral_constant<size_t, 0>());
+
+    auto bounded = stage_boundary<WordType>(chain, capacity, std::integral_constant<bool, Threaded>());
+    return close_chain<WordType, Threaded>(bounded | through(stages[i]), stages, i + 1, capacity, dst, std::integral_constant<size_t, Depth - 1>());
+}
+
+// Source, the "+" separated transforms of config.transform and sink as one
+// composition: "fused" runs all of it on one thread, "threaded" gives every
+// stage its own thread with an spsc_pipe of pipe_capacity in between. The
+// producer rate is the source's worker, the consumer rate the sink's.
+template<typename WordType>
+pipeline_result run_composed(pipeline_config const& config, bool print) {
+    pipeline_result result{0, 0};
+
+    std::vector<std::shared_ptr<transform>> stages;
+    for (auto const& name : split(config.transform, '+')) {
+        if (name != "none") stages.push_back(std::make_shared<transform>(name, config.isa));
+    }
+    if (stages.size() > max_composed_stages) {
+        if (print) printf("%s: skipped, at most %zu composed transforms\n", config.name().c_str(), max_composed_stages);
+        return result;
+    }
+
+    bool threaded = config.compose == "threaded";
+    size_t threads = threaded ? stages.size() + 2 : 1;
+    placement where = make_placement(config.placement, config.cpus, config.mem_node, 1, threads - 1);
+    if (!where.error.empty()) {
+        if (print) printf("%s: skipped, %s placement %s\n", config.name().c_str(), config.placement.c_str(), where.error.c_str());
+        return result;
+    }
+    memory_binding binding(where);
+    buffer_arena::instance().set_mode(parse_page_mode(config.pages));
+
+    size_t chunk_size = config.chunk_size / sizeof(WordType);
+    size_t capacity = config.pipe_capacity / sizeof(WordType);
+    auto depth = std::integral_constant<size_t, max_composed_stages>();
+
+    with_source<WordType>(config, [&](auto make_src) {
+        with_plain_sink<WordType>(config, [&](auto make_dst) {
+            auto src = make_src();
+            auto dst = make_dst();
+            auto chain = compose<WordType>(src, chunk_size);
+            auto workers = threaded ? close_chain<WordType, true>(chain, stages, 0, capacity, dst, depth)
+                                    : close_chain<WordType, false>(chain, stages, 0, capacity, dst, depth);
+
+            auto data = run(config.name(), workers, config.sample_count, print, where);
+            result.producer_rate = total_rate(data, 0, 1);
+            result.consumer_rate = total_rate(data, workers.size() - 1, workers.size());
+
+            if (print && workers.size() > 1) {
+                printf("producer: %9zu KiB/s, consumer: %9zu KiB/s\n", result.producer_rate, result.consumer_rate);
+            }
+
+            if (print) print_pages(parse_page_mode(config.pages));
+            if (print) print_backend(src);
+            if (print) print_backend(dst);
+            for (size_t i = 0; print && i < stages.size(); i++) {
+                if (stages[i]->checksum()) {
+                    printf("%s: %#018lx over %lu bytes (stage %zu)\n", stages[i]->name().c_str(), stages[i]->digest(), stages[i]->bytes(), i);
+                } else {
+                    printf("%s (stage %zu)\n", stages[i]->name().c_str(), i);
+                }
+            }
+            if (print) report_latency();
+        });
+    });
+
+    return result;
+}
+
+template<typename WordType>
+pipeline_result run_pipeline(pipeline_config const& config, bool print = true) {
+    pipeline_result result{0, 0};
+
+    // fixed_pipe keeps track of one reservation and one peek only, so
+    // direct workers need it 1:1 as well
+    bool single = config.producers == 1 && config.consumers == 1;
+    if ((config.pipe == "spsc" || config.worker == "direct") && !single) {
+        if (print) printf("%s: skipped, pipe does not support %zu:%zu workers\n", config.name().c_str(), config.producers, config.consumers);
+        return result;
+    }
+
+    if (config.compose != "off") return run_composed<WordType>(config, print);
+
+    if (config.transform.find('+') != std::string::npos) {
+        if (print) printf("%s: skipped, chained transforms need --compose\n", config.name().c_str());
+        return result;
+    }
+    if (config.process == "fork") {
+        if (print) printf("%s: skipped, forked consumers need the shm pipe\n", config.name().c_str());
+        return result;
+    }
+
+    if (config.dag != "none" || config.dedup != "off") {
+        if (print) printf("%s: skipped, dag pipelines and dedup are virtual hierarchy only\n", config.name().c_str());
+        return result;
+    }
+
+    placement where = make_placement(config);
+    if (!where.error.empty()) {
+        if (print) printf("%s: skipped, %s placement %s\n", config.name().c_str(), config.placement.c_str(), where.error.c_str());
+        return result;
+    }
+    memory_binding binding(where);
+    buffer_arena::instance().set_mode(parse_page_mode(config.pages));
+
+    size_t chunk_size = config.chunk_size / sizeof(WordType);
+    size_t chunk_min = config.chunk_min / sizeof(WordType);
+    size_t chunk_max = config.chunk_max / sizeof(WordType);
+
+    with_source<WordType>(config, [&](auto make_src) {
+        with_sink<WordType>(config, [&](auto make_dst) {
+            with_pipe<WordType>(config, [&](auto pipe) {
+                using SourceType = typename decltype(make_src())::element_type;
+                using SinkType = typename decltype(make_dst())::element_type;
+                using PipeType = typename decltype(pipe)::element_type;
+
+                std::vector<std::shared_ptr<worker>> workers;
+                std::vector<std::shared_ptr<SourceType>> srcs;
+                std::vector<std::shared_ptr<SinkType>> sinks;
+                for (size_t i = 0; i < config.producers; i++) {
+                    srcs.push_back(make_src());
+                    if (config.worker == "direct") workers.push_back(make_aligned<fill_worker<WordType, SourceType, PipeType>>(srcs.back(), pipe, chunk_size));
+                    else if (config.worker == "adaptive") workers.push_back(make_aligned<adaptive_worker<WordType, SourceType, PipeType>>(srcs.back(), pipe, chunk_size, chunk_min, chunk_max));
+                    else workers.push_back(make_aligned<fixed_worker<WordType, SourceType, PipeType>>(srcs.back(), pipe, chunk_size));
+                }
+                for (size_t i = 0; i < config.consumers; i++) {
+                    sinks.push_back(make_dst());
+                    if (config.worker == "direct") workers.push_back(make_aligned<drain_worker<WordType, PipeType, SinkType>>(pipe, sinks.back()));
+                    else if (config.worker == "adaptive") workers.push_back(make_aligned<adaptive_worker<WordType, PipeType, SinkType>>(pipe, sinks.back(), chunk_size, chunk_min, chunk_max));
+                    else workers.push_back(make_aligned<fixed_worker<WordType, PipeType, SinkType>>(pipe, sinks.back(), chunk_size));
+                }
+
+                auto data = run(config.name(), workers, config.sample_count, print, where);
+                result.producer_rate = total_rate(data, 0, config.producers);
+                result.consumer_rate = total_rate(data, config.producers, config.producers + config.consumers);
+
+                if (print && workers.size() > 2) {
+                    printf("producers: %9zu KiB/s, consumers: %9zu KiB/s\n", result.producer_rate, result.consumer_rate);
+                }
+
+                if (print) print_pages(parse_page_mode(config.pages));
+                if (print) print_backend(srcs.front());
+                if (print) print_backend(sinks.front());
+                if (print) print_transform(sinks.front(), config.producers + 1);
+                if (print) report_latency();
+            });
+        });
+    });
+
+    return result;
+}
+
+}
+
+#endif
@@ -3,6 +3,16 @@
 
 #include <ios>
 #include <fstream>
+#include <cstdio>
+#include <algorithm>
+#include <memory>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "async_io.h"
+#include "transform.h"
 
 namespace ygg {
 
@@ -33,6 +43,100 @@ class file_sink : public sink<WordType, file_sink<WordType>> {
         void stop() {}
 };
 
+// Writes through a sliding shared mapping, see mmap_file_sink in sink.h.
+template<typename WordType>
+class mmap_file_sink : public sink<WordType, mmap_file_sink<WordType>> {
+    int fd;
+    size_t window_size;
+    size_t window_offset;
+    size_t write_idx;
+    char* window;
+
+    void map_next() {
+        if (window) {
+            munmap(window, window_size);
+            window_offset += window_size;
+        }
+        window = nullptr;
+        write_idx = 0;
+
+        if (ftruncate(fd, window_offset + window_size) != 0) {
+            perror("ftruncate");
+            return;
+        }
+
+        void* addr = mmap(nullptr, window_size, PROT_WRITE, MAP_SHARED, fd, window_offset);
+        if (addr == MAP_FAILED) {
+            perror("mmap");
+            return;
+        }
+        window = static_cast<char*>(addr);
+    }
+
+    public:
+        // window_size is in bytes and must be a multiple of the page size
+        mmap_file_sink(char const* filename, size_t window_size = 64*1024*1024) :
+            fd(open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)),
+            window_size(window_size),
+            window_offset(0),
+            write_idx(0),
+            window(nullptr)
+        {
+            if (fd < 0) perror(filename);
+        }
+
+        ~mmap_file_sink() {
+            if (window) munmap(window, window_size);
+            if (fd >= 0) {
+                if (ftruncate(fd, window_offset + write_idx) != 0) perror("ftruncate");
+                close(fd);
+            }
+        }
+
+        size_t put(WordType* src, size_t n) {
+            if (fd < 0) return n;
+
+            char* bytes = reinterpret_cast<char*>(src);
+            size_t total = n * sizeof(WordType);
+            size_t total_count = 0;
+            while (total_count < total) {
+                if (!window || write_idx == window_size) {
+                    map_next();
+                    if (!window) break;
+                }
+
+                size_t count = std::min(window_size - write_idx, total - total_count);
+                std::copy(bytes + total_count, bytes + total_count + count, window + write_idx);
+                write_idx += count;
+                total_count += count;
+            }
+
+            return n;
+        }
+
+        void stop() {}
+};
+
+// Keeps up to queue_depth block writes in flight, see uring_file_sink in
+// sink.h.
+template<typename WordType>
+class uring_file_sink : public sink<WordType, uring_file_sink<WordType>> {
+    async_writer writer;
+
+    public:
+        uring_file_sink(char const* filename, size_t queue_depth = 8, size_t block_size = 256*1024) :
+            writer(filename, queue_depth, block_size) {}
+
+        char const* backend() const { return writer.backend(); }
+
+        size_t put(WordType* src, size_t n) {
+            writer.write(reinterpret_cast<char*>(src), n * sizeof(WordType));
+            return n;
+        }
+
+        void stop() {}
+};
+
 template<typename WordType>
 class null_sink : public sink<WordType, null_sink<WordType>> {
     public:
@@ -40,6 +144,36 @@ class null_sink : public sink<WordType, null_sink<WordType>> {
         void stop() {}
 };
 
+// Runs every chunk through a transform stage before SinkType sees it, see
+// transform_sink in sink.h.
+template<typename WordType, typename SinkType>
+class transform_sink : public sink<WordType, transform_sink<WordType, SinkType>> {
+    std::shared_ptr<SinkType> dst;
+    ygg::transform stage;
+
+    public:
+        transform_sink(std::shared_ptr<SinkType> dst, ygg::transform stage) :
+            dst(dst),
+            stage(stage) {}
+
+        size_t put(WordType* src, size_t n) {
+            stage.apply(reinterpret_cast<char*>(src), n * sizeof(WordType));
+
+            size_t write_idx = 0;
+            while (write_idx < n) {
+                size_t count = dst->put(src + write_idx, n - write_idx);
+                if (count == 0) break;
+                write_idx += count;
+            }
+            return write_idx;
+        }
+
+        void stop() { dst->stop(); }
+
+        ygg::transform const& transform() const { return stage; }
+        std::shared_ptr<SinkType> const& next() const { return dst; }
+};
+
 }
 
 #endif
@@ -6,6 +6,17 @@
 #include <random>
 #include <array>
 #include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "async_io.h"
+#include "rng.h"
 
 namespace ygg {
 
@@ -43,6 +54,110 @@ class file_source : public source<WordType, file_source<WordType>> {
         void stop() {}
 };
 
+// Maps the whole input once, see mmap_file_source in source.h. A trailing
+// partial word is ignored.
+template<typename WordType>
+class mmap_file_source : public source<WordType, mmap_file_source<WordType>> {
+    WordType* data;
+    size_t size;
+    size_t read_idx;
+    size_t mapped_size;
+
+    public:
+        mmap_file_source(char const* filename) :
+            data(nullptr),
+            size(0),
+            read_idx(0),
+            mapped_size(0)
+        {
+            int fd = open(filename, O_RDONLY);
+            if (fd < 0) {
+                perror(filename);
+                return;
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(WordType)) {
+                void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr != MAP_FAILED) {
+                    data = static_cast<WordType*>(addr);
+                    mapped_size = st.st_size;
+                    size = mapped_size / sizeof(WordType);
+                    madvise(addr, mapped_size, MADV_SEQUENTIAL);
+                } else {
+                    perror(filename);
+                }
+            }
+
+            close(fd);
+        }
+
+        ~mmap_file_source() {
+            if (data) munmap(data, mapped_size);
+        }
+
+        span<WordType> next(size_t n) {
+            span<WordType> region{data + read_idx, std::min(size - read_idx, n)};
+            read_idx += region.size;
+            if (read_idx == size) read_idx = 0;
+            return region;
+        }
+
+        size_t get(WordType* dst, size_t n) {
+            span<WordType> region = next(n);
+            std::copy(region.data, region.data + region.size, dst);
+            return region.size;
+        }
+
+        void stop() {}
+};
+
+// Keeps queue_depth reads in flight, see uring_file_source in source.h.
+// block_size must be a multiple of sizeof(WordType); a trailing partial
+// word at EOF is dropped.
+template<typename WordType>
+class uring_file_source : public source<WordType, uring_file_source<WordType>> {
+    async_reader reader;
+
+    public:
+        uring_file_source(char const* filename, size_t queue_depth = 8, size_t block_size = 256*1024) :
+            reader(filename, queue_depth, block_size) {}
+
+        char const* backend() const { return reader.backend(); }
+
+        size_t get(WordType* dst, size_t n) {
+            return reader.read(reinterpret_cast<char*>(dst), n * sizeof(WordType)) / sizeof(WordType);
+        }
+
+        void stop() {}
+};
+
+// See random_source in source.h.
+template<typename WordType>
+class random_source : public source<WordType, random_source<WordType>> {
+    xoshiro_lanes gen;
+
+    static uint64_t pick_seed(uint64_t seed) {
+        if (seed != 0) return seed;
+        std::random_device rd;
+        return (static_cast<uint64_t>(rd()) << 32) | rd();
+    }
+
+    public:
+        random_source(uint64_t seed = 0) :
+            gen(pick_seed(seed)) {}
+
+        // the xoshiro kernel that fills dst, avx2 or scalar
+        isa kernel() const { return gen.kernel(); }
+
+        size_t get(WordType* dst, size_t n) {
+            gen.fill(reinterpret_cast<char*>(dst), n * sizeof(WordType));
+            return n;
+        }
+
+        void stop() {}
+};
+
 template<typename WordType, size_t Capacity>
 class random_buf_source : public source<WordType, random_buf_source<WordType, Capacity>> {
     std::random_device seed;
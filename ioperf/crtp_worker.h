@@ -0,0 +1,205 @@
+#ifndef CRTP_WORKER_H
+#define CRTP_WORKER_H
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <atomic>
+
+#include "sampling.h"
+#include "adaptive.h"
+#include "arena.h"
+#include "util.h"
+#include "histogram.h"
+
+namespace ygg {
+
+// Workers for the CRTP hierarchy. They are started, polled and stopped
+// through the worker interface, but the transfer loop is bound statically
+// to SourceType and SinkType. Chunk sizes are in words; poll() reports bytes.
+
+template<typename WordType, typename SourceType, typename SinkType>
+class fixed_worker : public worker {
+    arena_buffer<WordType> buf;
+    std::shared_ptr<SourceType> src;
+    std::shared_ptr<SinkType> dst;
+    std::atomic<bool> stopped;
+    progress_counter elts_written;
+
+    latency_probe get_latency;
+    latency_probe put_latency;
+
+    public:
+        fixed_worker(std::shared_ptr<SourceType> src, std::shared_ptr<SinkType> dst, size_t chunk_size) :
+            buf(chunk_size),
+            src(src),
+            dst(dst),
+            stopped(false),
+            get_latency("source get"),
+            put_latency("sink put") {}
+
+        virtual void work(std::string name) override {
+            get_latency.label(name + " source get");
+            put_latency.label(name + " sink put");
+
+            while (!stopped) {
+                size_t count;
+                {
+                    scoped_latency t(get_latency);
+                    count = src->get(buf.data(), buf.size());
+                }
+
+                size_t write_idx = 0;
+                while (write_idx < count && !stopped) {
+                    scoped_latency t(put_latency);
+                    write_idx += dst->put(buf.data() + write_idx, count - write_idx);
+                }
+                elts_written.add(count); 
+            }
+        }
+
+        virtual void poll(data_point& data) override {
+            data.time = clock::now();
+            data.count = elts_written.load() * sizeof(WordType);
+        }
+
+        virtual void stop() override {
+            stopped = true;
+            src->stop();
+            dst->stop();
+        }
+};
+
+// Like fixed_worker, but the transfer size (in words) is tuned at runtime
+// by a chunk_controller between min_size and max_size.
+template<typename WordType, typename SourceType, typename SinkType>
+class adaptive_worker : public worker {
+    arena_buffer<WordType> buf;
+    std::shared_ptr<SourceType> src;
+    std::shared_ptr<SinkType> dst;
+    chunk_controller controller;
+    std::atomic<bool> stopped;
+    progress_counter elts_written;
+    std::atomic<size_t> chunk_size;
+
+    public:
+        adaptive_worker(std::shared_ptr<SourceType> src, std::shared_ptr<SinkType> dst, size_t chunk_size, size_t min_size, size_t max_size) :
+            buf(std::max(min_size, max_size)),
+            src(src),
+            dst(dst),
+            controller(chunk_size, min_size, max_size),
+            stopped(false),
+            chunk_size(controller.size()) {}
+
+        virtual void work(std::string) override {
+            while (!stopped) {
+                size_t n = controller.size();
+                size_t count = src->get(buf.data(), n);
+                bool short_transfer = count < n;
+
+                size_t write_idx = 0;
+                while (write_idx < count && !stopped) {
+                    size_t written = dst->put(buf.data() + write_idx, count - write_idx);
+                    short_transfer = short_transfer || written < count - write_idx;
+                    write_idx += written;
+                }
+                elts_written.add(count);
+
+                controller.record(count, short_transfer);
+                chunk_size.store(controller.size(), std::memory_order_relaxed);
+            }
+        }
+
+        virtual void poll(data_point& data) override {
+            data.time = clock::now();
+            data.count = elts_written.load() * sizeof(WordType);
+            data.chunk_size = chunk_size.load(std::memory_order_relaxed) * sizeof(WordType);
+        }
+
+        virtual void stop() override {
+            stopped = true;
+            src->stop();
+            dst->stop();
+        }
+};
+
+// Lets the source write straight into the pipe's buffer.
+template<typename WordType, typename SourceType, typename PipeType>
+class fill_worker : public worker {
+    std::shared_ptr<SourceType> src;
+    std::shared_ptr<PipeType> dst;
+    size_t chunk_size;
+    std::atomic<bool> stopped;
+    progress_counter elts_written;
+
+    public:
+        fill_worker(std::shared_ptr<SourceType> src, std::shared_ptr<PipeType> dst, size_t chunk_size) :
+            src(src),
+            dst(dst),
+            chunk_size(chunk_size),
+            stopped(false) {}
+
+        virtual void work(std::string) override {
+            while (!stopped) {
+                span<WordType> region = dst->reserve(chunk_size);
+                size_t count = region.size > 0 ? src->get(region.data, region.size) : 0;
+                dst->commit(count);
+                elts_written.add(count);
+            }
+        }
+
+        virtual void poll(data_point& data) override {
+            data.time = clock::now();
+            data.count = elts_written.load() * sizeof(WordType);
+        }
+
+        virtual void stop() override {
+            stopped = true;
+            src->stop();
+            dst->stop();
+        }
+};
+
+// Hands the readable part of the pipe's buffer to the sink in place.
+template<typename WordType, typename PipeType, typename SinkType>
+class drain_worker : public worker {
+    std::shared_ptr<PipeType> src;
+    std::shared_ptr<SinkType> dst;
+    std::atomic<bool> stopped;
+    progress_counter elts_written;
+
+    public:
+        drain_worker(std::shared_ptr<PipeType> src, std::shared_ptr<SinkType> dst) :
+            src(src),
+            dst(dst),
+            stopped(false) {}
+
+        virtual void work(std::string) override {
+            while (!stopped) {
+                span<WordType> region = src->peek();
+
+                size_t read_idx = 0;
+                while (read_idx < region.size && !stopped) {
+                    read_idx += dst->put(region.data + read_idx, region.size - read_idx);
+                }
+                src->consume(read_idx);
+                elts_written.add(read_idx);
+            }
+        }
+
+        virtual void poll(data_point& data) override {
+            data.time = clock::now();
+            data.count = elts_written.load() * sizeof(WordType);
+        }
+
+        virtual void stop() override {
+            stopped = true;
+            src->stop();
+            dst->stop();
+        }
+};
+
+}
+
+#endif
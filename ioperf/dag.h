@@ -0,0 +1,296 @@
+#ifndef DAG_H
+#define DAG_H
+
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "arena.h"
+#include "histogram.h"
+#include "wait.h"
+#include "sampling.h"
+#include "source.h"
+#include "sink.h"
+#include "pipe.h"
+
+namespace ygg {
+
+// Stages for pipelines that aren't a single line: a tee that hands every
+// byte to several branches, a split that deals whole chunks out over
+// several pipes, and an ordered merge that takes them back in turn. All of
+// them block on a full or empty pipe like any other worker, so the slowest
+// branch holds back the source.
+
+// One ring with a single writer and a read cursor per branch. Space is
+// freed once every branch has consumed it, so the branches share the
+// writer's bytes instead of each getting a copy: the cursors act as a
+// reference count on the ring. Each branch parks on its own waiter and the
+// writer on another, so a commit wakes the branches and a consume the
+// writer.
+template<typename Wait = yield_wait>
+class broadcast_ring {
+    struct cursor {
+        alignas(cache_line_size) std::atomic<size_t> read_idx;
+        size_t cached_write_idx;
+        Wait waiter;
+
+        cursor() :
+            read_idx(0),
+            cached_write_idx(0) {}
+    };
+
+    arena_buffer<char> buf;
+    size_t capacity;
+    size_t mask;
+
+    // writer-owned
+    alignas(cache_line_size) std::atomic<size_t> write_idx;
+    size_t cached_read_idx; // of the slowest branch
+    Wait writer_waiter;
+
+    alignas(cache_line_size) std::atomic<bool> stopped;
+    std::vector<std::shared_ptr<cursor>> cursors;
+
+    latency_probe full_wait;
+    latency_probe empty_wait;
+
+    size_t slowest_read_idx() const {
+        size_t res = write_idx.load(std::memory_order_relaxed);
+        for (auto const& c : cursors) res = std::min(res, c->read_idx.load(std::memory_order_acquire));
+        return res;
+    }
+
+    public:
+        // capacity is rounded up to a power of two
+        broadcast_ring(size_t capacity, size_t branches) :
+            buf(next_pow2(capacity)),
+            capacity(next_pow2(capacity)),
+            mask(next_pow2(capacity) - 1),
+            write_idx(0),
+            cached_read_idx(0),
+            stopped(false),
+            full_wait("tee full wait"),
+            empty_wait("tee empty wait")
+        {
+            for (size_t i = 0; i < std::max<size_t>(branches, 1); i++) cursors.push_back(make_aligned<cursor>());
+        }
+
+        size_t branches() const { return cursors.size(); }
+
+        span<char> reserve(size_t n) {
+            size_t w = write_idx.load(std::memory_order_relaxed);
+
+            if (w - cached_read_idx == capacity) cached_read_idx = slowest_read_idx();
+            if (w - cached_read_idx == capacity) {
+                timed_wait(writer_waiter, full_wait, [&]{
+                    cached_read_idx = slowest_read_idx();
+                    return w - cached_read_idx != capacity || stopped;
+                });
+                if (w - cached_read_idx == capacity) return {buf.data(), 0};
+            }
+
+            size_t offset = w & mask;
+            size_t count = std::min(capacity - (w - cached_read_idx), capacity - offset);
+            return {buf.data() + offset, std::min(count, n)};
+        }
+
+        void commit(size_t n) {
+            write_idx.store(write_idx.load(std::memory_order_relaxed) + n, std::memory_order_release);
+            for (auto& c : cursors) c->waiter.notify();
+        }
+
+        span<char> peek(size_t branch) {
+            cursor& c = *cursors[branch];
+            size_t r = c.read_idx.load(std::memory_order_relaxed);
+
+            if (c.cached_write_idx == r) c.cached_write_idx = write_idx.load(std::memory_order_acquire);
+            if (c.cached_write_idx == r) {
+                timed_wait(c.waiter, empty_wait, [&]{
+                    c.cached_write_idx = write_idx.load(std::memory_order_acquire);
+                    return c.cached_write_idx != r || stopped;
+                });
+                if (c.cached_write_idx == r) return {buf.data(), 0};
+            }
+
+            size_t offset = r & mask;
+            return {buf.data() + offset, std::min(c.cached_write_idx - r, capacity - offset)};
+        }
+
+        void consume(size_t branch, size_t n) {
+            cursor& c = *cursors[branch];
+            c.read_idx.store(c.read_idx.load(std::memory_order_relaxed) + n, std::memory_order_release);
+            writer_waiter.notify();
+        }
+
+        void stop() {
+            stopped = true;
+            writer_waiter.notify_all();
+            for (auto& c : cursors) c->waiter.notify_all();
+        }
+};
+
+// One branch of a broadcast_ring as a pipe. Reading takes from this
+// branch's cursor; writing, through any branch, goes to all of them. There
+// must be only one writer for the whole ring, and stopping one branch stops
+// the ring.
+template<typename Wait = yield_wait>
+class tee_pipe : public pipe {
+    std::shared_ptr<broadcast_ring<Wait>> ring;
+    size_t branch;
+
+    public:
+        tee_pipe(std::shared_ptr<broadcast_ring<Wait>> ring, size_t branch) :
+            ring(ring),
+            branch(branch) {}
+
+        virtual size_t put(char* src, std::streamsize n) override {
+            span<char> region = ring->reserve(n);
+            std::memcpy(region.data, src, region.size);
+            ring->commit(region.size);
+            return region.size;
+        }
+
+        virtual size_t get(char* dst, std::streamsize n) override {
+            span<char> region = ring->peek(branch);
+            size_t count = std::min<size_t>(region.size, n);
+            std::memcpy(dst, region.data, count);
+            ring->consume(branch, count);
+            return count;
+        }
+
+        virtual span<char> reserve(size_t n) override { return ring->reserve(n); }
+        virtual void commit(size_t n) override { ring->commit(n); }
+        virtual span<char> peek() override { return ring->peek(branch); }
+        virtual void consume(size_t n) override { ring->consume(branch, n); }
+        virtual void stop() override { ring->stop(); }
+};
+
+// The branches of a new broadcast ring.
+template<typename Wait = yield_wait>
+std::vector<std::shared_ptr<pipe>> make_tee(size_t capacity, size_t branches) {
+    auto ring = make_aligned<broadcast_ring<Wait>>(capacity, branches);
+    std::vector<std::shared_ptr<pipe>> res;
+    for (size_t i = 0; i < ring->branches(); i++) res.push_back(std::make_shared<tee_pipe<Wait>>(ring, i));
+    return res;
+}
+
+// Reads whole chunks of exactly chunk_size bytes and puts each one, whole,
+// into one of the outputs: in turn ("round-robin") or by a hash of its
+// first eight bytes ("hash"), so chunks with the same key always take the
+// same branch. A full output blocks the split until it drains.
+class split_worker : public worker {
+    public:
+        enum policy_type { round_robin, hash };
+
+    private:
+        arena_buffer<char> buf;
+        std::shared_ptr<source> src;
+        std::vector<std::shared_ptr<pipe>> outputs;
+        policy_type policy;
+        size_t next;
+        std::atomic<bool> stopped;
+        progress_counter bytes_written;
+
+        size_t pick(size_t count) {
+            if (policy == round_robin) return next++ % outputs.size();
+
+            uint64_t key = 0;
+            std::memcpy(&key, buf.data(), std::min<size_t>(count, sizeof(key)));
+            return ((key * 0x9e3779b97f4a7c15ull) >> 32) % outputs.size();
+        }
+
+    public:
+        split_worker(std::shared_ptr<source> src, std::vector<std::shared_ptr<pipe>> outputs, size_t chunk_size, policy_type policy) :
+            buf(chunk_size),
+            src(src),
+            outputs(outputs),
+            policy(policy),
+            next(0),
+            stopped(false) {}
+
+        virtual void work(std::string) override {
+            while (!stopped) {
+                size_t count = 0;
+                while (count < buf.size() && !stopped) count += src->get(buf.data() + count, buf.size() - count);
+                if (count == 0) continue;
+
+                auto& dst = outputs[pick(count)];
+                size_t write_idx = 0;
+                while (write_idx < count && !stopped) write_idx += dst->put(buf.data() + write_idx, count - write_idx);
+                bytes_written.add(count);
+            }
+        }
+
+        virtual void poll(data_point& data) override {
+            data.time = clock::now();
+            data.count = bytes_written.load();
+        }
+
+        virtual void stop() override {
+            stopped = true;
+            src->stop();
+            for (auto& dst : outputs) dst->stop();
+        }
+};
+
+// Takes exactly chunk_size bytes from each input in turn and puts them into
+// the sink, so chunks come out in the order a round-robin split_worker with
+// the same chunk size dealt them. An empty input holds up the others. The
+// inputs are read with peek/consume, which take part of a chunk_pipe slot
+// as readily as part of a ring.
+class merge_worker : public worker {
+    arena_buffer<char> buf;
+    std::vector<std::shared_ptr<pipe>> inputs;
+    std::shared_ptr<sink> dst;
+    size_t next;
+    std::atomic<bool> stopped;
+    progress_counter bytes_written;
+
+    public:
+        merge_worker(std::vector<std::shared_ptr<pipe>> inputs, std::shared_ptr<sink> dst, size_t chunk_size) :
+            buf(chunk_size),
+            inputs(inputs),
+            dst(dst),
+            next(0),
+            stopped(false) {}
+
+        virtual void work(std::string) override {
+            while (!stopped) {
+                auto& src = inputs[next];
+                size_t count = 0;
+                while (count < buf.size() && !stopped) {
+                    span<char> region = src->peek();
+                    if (region.size == 0) continue;
+                    size_t n = std::min(region.size, buf.size() - count);
+                    std::memcpy(buf.data() + count, region.data, n);
+                    src->consume(n);
+                    count += n;
+                }
+                if (count == buf.size()) next = (next + 1) % inputs.size();
+
+                size_t write_idx = 0;
+                while (write_idx < count && !stopped) write_idx += dst->put(buf.data() + write_idx, count - write_idx);
+                bytes_written.add(count);
+            }
+        }
+
+        virtual void poll(data_point& data) override {
+            data.time = clock::now();
+            data.count = bytes_written.load();
+        }
+
+        virtual void stop() override {
+            stopped = true;
+            for (auto& src : inputs) src->stop();
+            dst->stop();
+        }
+};
+
+}
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "rng.h"
+#include "transform.h"
+
+namespace ygg {
+
+// Content-defined chunking in the style of FastCDC: a gear hash rolls over
+// the stream (one shift and one table add per byte, so only the last 64
+// bytes count) and a chunk ends where the masked hash is zero. The first
+// min_size bytes of a chunk are skipped outright. Up to the average size
+// the mask has two more bits than log2(average), past it two fewer, which
+// pulls chunk sizes towards the average ("normalized chunking"). Chunks
+// never exceed max_size. Since the cut points only depend on the bytes
+// around them, an insertion only moves the chunks it touches and repeated
+// regions are cut the same way wherever they appear.
+class cdc_chunker {
+    size_t min_size;
+    size_t avg_size;
+    size_t max_size;
+    uint64_t mask_s;
+    uint64_t mask_l;
+    size_t pos;
+    uint64_t hash;
+
+    static uint64_t const* gear() {
+        static uint64_t const* table = [] {
+            static uint64_t t[256];
+            uint64_t seed = 0x6765617263646321ull;
+            for (auto& g : t) g = splitmix64(seed);
+            return t;
+        }();
+        return table;
+    }
+
+    // bits ones at the top of the word, where the hash has seen the most bytes
+    static uint64_t top_mask(size_t bits) {
+        return bits == 0 ? 0 : ~0ull << (64 - std::min<size_t>(bits, 63));
+    }
+
+    static size_t bits_of(size_t n) {
+        size_t res = 0;
+        while ((size_t(2) << res) <= n) res++;
+        return res;
+    }
+
+    size_t end_chunk(size_t count) {
+        pos = 0;
+        hash = 0;
+        return count;
+    }
+
+    public:
+        // avg_size is rounded up to a power of two; min and max are a
+        // quarter and eight times of it
+        cdc_chunker(size_t avg_size) :
+            min_size(next_pow2(std::max<size_t>(avg_size, 256)) / 4),
+            avg_size(next_pow2(std::max<size_t>(avg_size, 256))),
+            max_size(next_pow2(std::max<size_t>(avg_size, 256)) * 8),
+            mask_s(top_mask(bits_of(this->avg_size) + 2)),
+            mask_l(top_mask(bits_of(this->avg_size) - 2)),
+            pos(0),
+            hash(0) {}
+
+        size_t min_chunk() const { return min_size; }
+        size_t avg_chunk() const { return avg_size; }
+        size_t max_chunk() const { return max_size; }
+
+        // Scans data as the continuation of the current chunk. Returns how
+        // many bytes of it belong to the chunk; cut tells whether the chunk
+        // ends there, in which case the next call starts a new one.
+        size_t scan(char const* data, size_t n, bool& cut) {
+            uint64_t const* g = gear();
+            size_t i = std::min(n, min_size - std::min(pos, min_size));
+            size_t p = pos + i;
+            uint64_t h = hash;
+            cut = true;
+
+            for (; i < n && p < avg_size; i++, p++) {
+                h = (h << 1) + g[static_cast<uint8_t>(data[i])];
+                if (!(h & mask_s)) return end_chunk(i + 1);
+            }
+            for (; i < n && p < max_size; i++, p++) {
+                h = (h << 1) + g[static_cast<uint8_t>(data[i])];
+                if (!(h & mask_l)) return end_chunk(i + 1);
+            }
+            if (p == max_size) return end_chunk(i);
+
+            cut = false;
+            pos = p;
+            hash = h;
+            return n;
+        }
+};
+
+// The set of chunk fingerprints seen so far: open addressing with linear
+// probing over a power-of-two table, 0 marking an empty slot. The table
+// doubles once it is three quarters full, so a probe stays short.
+class dedup_index {
+    std::vector<uint64_t> slots;
+    size_t mask;
+    size_t count;
+
+    static uint64_t key(uint64_t fingerprint) { return fingerprint ? fingerprint : 1; }
+
+    void grow() {
+        std::vector<uint64_t> old(slots.size() * 2, 0);
+        old.swap(slots);
+        mask = slots.size() - 1;
+        for (uint64_t k : old) {
+            if (!k) continue;
+            size_t i = k & mask;
+            while (slots[i]) i = (i + 1) & mask;
+            slots[i] = k;
+        }
+    }
+
+    public:
+        dedup_index(size_t capacity = 64*1024) :
+            slots(next_pow2(std::max<size_t>(capacity, 16)), 0),
+            mask(slots.size() - 1),
+            count(0) {}
+
+        // true if fingerprint was new, and adds it
+        bool insert(uint64_t fingerprint) {
+            uint64_t k = key(fingerprint);
+            size_t i = k & mask;
+            while (slots[i]) {
+                if (slots[i] == k) return false;
+                i = (i + 1) & mask;
+            }
+
+            slots[i] = k;
+            if (++count * 4 > slots.size() * 3) grow();
+            return true;
+        }
+
+        size_t size() const { return count; }
+        size_t capacity() const { return slots.size(); }
+};
+
+// What a dedup stage emits per chunk: a novel chunk is this header followed
+// by its bytes, a repeat is the header alone, referring back to the earlier
+// chunk with the same fingerprint.
+struct chunk_record {
+    uint32_t length;
+    uint32_t novel;
+    uint64_t fingerprint;
+};
+
+// 64-bit fingerprint of a chunk, with the xxhash kernel of the given level
+inline uint64_t chunk_fingerprint(char const* data, size_t n, isa level) {
+    hash64_state s;
+    if (level == isa::avx2) hash64_avx2(s, data, n);
+    else if (level == isa::sse42) hash64_sse42(s, data, n);
+    else hash64_scalar(s, data, n);
+    return s.digest();
+}
+
+// Running totals of a dedup stage
+struct dedup_stats {
+    uint64_t chunks = 0;
+    uint64_t novel_chunks = 0;
+    uint64_t bytes_in = 0;
+    uint64_t novel_bytes = 0;
+    uint64_t bytes_out = 0;
+    uint64_t busy_ns = 0;
+
+    // input bytes per output byte, headers included
+    double ratio() const { return bytes_out ? static_cast<double>(bytes_in) / bytes_out : 0; }
+
+    std::string str() const {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%lu chunks, %lu bytes mean, %.1f%% duplicate, %lu bytes in, %lu out, ratio %.2f:1, %.0f MB/s in the stage",
+                chunks, chunks ? bytes_in / chunks : 0, chunks ? 100.0 * (chunks - novel_chunks) / chunks : 0.0,
+                bytes_in, bytes_out, ratio(), busy_ns ? 1e3 * bytes_in / busy_ns : 0.0);
+        return buf;
+    }
+};
+
+}
+
+#endif
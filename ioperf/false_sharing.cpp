@@ -0,0 +1,170 @@
+// Microbenchmark for the cache line layout of workers and pipes: the same
+// work with the fields two threads write packed into one cache line, and
+// with each thread's fields on a line of its own.
+//
+//   counters  every thread bumps its own byte counter, as the workers do;
+//             packed with a locked increment (the old workers), packed with
+//             a single-writer store, and as progress_counters
+//   indices   a producer and a consumer hand a ring's worth of slots back
+//             and forth through write_idx and read_idx, in one line or two
+//
+// Both threads are placed by --placement or --cpus like an ioperf run;
+// false sharing only shows when they end up on different cores.
+
+#include <cstdio>
+#include <iostream>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/program_options/parsers.hpp>
+
+#include "util.h"
+#include "sampling.h"
+#include "topology.h"
+#include "wait.h"
+
+namespace ygg {
+
+struct packed_counters {
+    std::atomic<uint64_t> value[2];
+};
+
+struct padded_counters {
+    progress_counter value[2];
+};
+
+struct packed_indices {
+    std::atomic<size_t> write_idx;
+    std::atomic<size_t> read_idx;
+};
+
+struct padded_indices {
+    alignas(cache_line_size) std::atomic<size_t> write_idx;
+    alignas(cache_line_size) std::atomic<size_t> read_idx;
+};
+
+// Spins briefly, then yields, so that two threads sharing a CPU still
+// make progress.
+template<typename Pred>
+void spin_until(Pred pred) {
+    for (size_t spins = 0; !pred(); spins++) {
+        if (spins < 64) cpu_relax();
+        else std::this_thread::yield();
+    }
+}
+
+// Runs f(w) on two threads placed by where, returns nanoseconds per
+// iteration.
+template<typename F>
+double time_pair(placement const& where, uint64_t iterations, F f) {
+    std::atomic<int> ready(0);
+    auto start = clock::now();
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < 2; w++) {
+        threads.emplace_back([&, w] {
+            where.apply(w);
+            ready++;
+            spin_until([&]{ return ready == 2; });
+            if (w == 0) start = clock::now();
+            f(w);
+        });
+    }
+    for (auto& t : threads) t.join();
+    return std::chrono::duration<double, std::nano>(clock::now() - start).count() / iterations;
+}
+
+inline double locked_counters(placement const& where, uint64_t iterations) {
+    auto c = make_aligned<packed_counters>();
+    c->value[0] = c->value[1] = 0;
+    return time_pair(where, iterations, [&](size_t w) {
+        for (uint64_t i = 0; i < iterations; i++) c->value[w] += 1;
+    });
+}
+
+inline double stored_counters(placement const& where, uint64_t iterations) {
+    auto c = make_aligned<packed_counters>();
+    c->value[0] = c->value[1] = 0;
+    return time_pair(where, iterations, [&](size_t w) {
+        auto& v = c->value[w];
+        for (uint64_t i = 0; i < iterations; i++) v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    });
+}
+
+inline double progress_counters(placement const& where, uint64_t iterations) {
+    auto c = make_aligned<padded_counters>();
+    return time_pair(where, iterations, [&](size_t w) {
+        for (uint64_t i = 0; i < iterations; i++) c->value[w].add(1);
+    });
+}
+
+// Producer (w0) may run capacity slots ahead of the consumer (w1).
+template<typename Indices>
+double ring_indices(placement const& where, uint64_t iterations) {
+    constexpr size_t capacity = 1024;
+    auto idx = make_aligned<Indices>();
+    idx->write_idx = 0;
+    idx->read_idx = 0;
+
+    return time_pair(where, iterations, [&](size_t w) {
+        if (w == 0) {
+            for (size_t i = 0; i < iterations; i++) {
+                spin_until([&]{ return i - idx->read_idx.load(std::memory_order_acquire) < capacity; });
+                idx->write_idx.store(i + 1, std::memory_order_release);
+            }
+        } else {
+            for (size_t i = 0; i < iterations; i++) {
+                spin_until([&]{ return idx->write_idx.load(std::memory_order_acquire) > i; });
+                idx->read_idx.store(i + 1, std::memory_order_release);
+            }
+        }
+    });
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    namespace po = boost::program_options;
+    using namespace ygg;
+
+    std::string layout;
+    std::string cpus;
+    uint64_t iterations;
+
+    po::options_description desc("Supported options");
+    desc.add_options()
+        ("help", "produce help message")
+        ("placement", po::value<std::string>(&layout)->default_value("same-socket"), "where the two threads run (none, auto, same-core, same-socket, cross-socket)")
+        ("cpus", po::value<std::string>(&cpus)->default_value(""), "explicit CPU list per thread, ':' separated, overrides --placement")
+        ("iterations", po::value<uint64_t>(&iterations)->default_value(100000000), "increments or slots per thread");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cout << desc << std::endl;
+        return 0;
+    }
+
+    placement where = make_placement(layout, cpus, -1, 1, 1);
+    if (!where.error.empty()) {
+        printf("%s placement %s\n", layout.c_str(), where.error.c_str());
+        return 1;
+    }
+    if (where.pinned()) printf("placement: %s\n", where.str().c_str());
+
+    printf("%-32s %10s\n", "layout", "ns/op");
+    printf("%-32s %10.2f\n", "counters, packed, locked add", locked_counters(where, iterations));
+    printf("%-32s %10.2f\n", "counters, packed, store", stored_counters(where, iterations));
+    printf("%-32s %10.2f\n", "counters, progress_counter", progress_counters(where, iterations));
+    printf("%-32s %10.2f\n", "indices, one line", ring_indices<packed_indices>(where, iterations));
+    printf("%-32s %10.2f\n", "indices, own lines", ring_indices<padded_indices>(where, iterations));
+
+    return 0;
+}
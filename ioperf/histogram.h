@@ -0,0 +1,283 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+
+namespace ygg {
+
+// Log-bucketed latency histogram in the style of HdrHistogram: values below
+// 32 get a bucket each, above that every power of two is split into 32
+// sub-buckets, so any recorded value is known to within ~3%. Meant to be
+// written by a single thread; the counters are relaxed atomics so a reader
+// may merge it at any time without a data race.
+class histogram {
+    static constexpr unsigned sub_bits = 5;
+    static constexpr uint64_t sub_count = 1 << sub_bits;
+    static constexpr size_t bucket_count = (64 - sub_bits + 1) * sub_count;
+
+    std::unique_ptr<std::atomic<uint64_t>[]> counts;
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> max_value;
+
+    static size_t index(uint64_t v) {
+        if (v < sub_count) return v;
+        unsigned e = 63 - __builtin_clzll(v);
+        return (e - sub_bits + 1) * sub_count + ((v >> (e - sub_bits)) & (sub_count - 1));
+    }
+
+    // highest value that maps to bucket idx
+    static uint64_t value(size_t idx) {
+        if (idx < sub_count) return idx;
+        unsigned e = idx / sub_count + sub_bits - 1;
+        uint64_t low = (sub_count + idx % sub_count) << (e - sub_bits);
+        return low + (uint64_t(1) << (e - sub_bits)) - 1;
+    }
+
+    static void bump(std::atomic<uint64_t>& a, uint64_t n) {
+        a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    public:
+        histogram() :
+            counts(new std::atomic<uint64_t>[bucket_count]),
+            total(0),
+            max_value(0)
+        {
+            for (size_t i = 0; i < bucket_count; i++) counts[i].store(0, std::memory_order_relaxed);
+        }
+
+        void record(uint64_t v) {
+            bump(counts[index(v)], 1);
+            bump(total, 1);
+            if (v > max_value.load(std::memory_order_relaxed)) max_value.store(v, std::memory_order_relaxed);
+        }
+
+        // not thread-safe with respect to other merges into this histogram
+        void merge(histogram const& other) {
+            for (size_t i = 0; i < bucket_count; i++) bump(counts[i], other.counts[i].load(std::memory_order_relaxed));
+            bump(total, other.total.load(std::memory_order_relaxed));
+            max_value.store(std::max(max(), other.max()), std::memory_order_relaxed);
+        }
+
+        uint64_t count() const { return total.load(std::memory_order_relaxed); }
+        uint64_t max() const { return max_value.load(std::memory_order_relaxed); }
+
+        uint64_t percentile(double p) const {
+            uint64_t n = count();
+            if (n == 0) return 0;
+
+            uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p / 100.0 * n + 0.5));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < bucket_count; i++) {
+                seen += counts[i].load(std::memory_order_relaxed);
+                if (seen >= rank) return std::min(value(i), max());
+            }
+            return max();
+        }
+};
+
+#ifdef IOPERF_LATENCY
+
+// Small dense id per live thread, used to pick a per-thread histogram. Ids
+// are handed back when their thread exits, so no two live threads share
+// one however many threads come and go over a run.
+class thread_slot_registry {
+    std::mutex mutex;
+    std::vector<size_t> released;
+    size_t next = 0;
+
+    public:
+        static thread_slot_registry& instance() { static thread_slot_registry r; return r; }
+
+        size_t acquire() {
+            std::lock_guard<std::mutex> guard(mutex);
+            if (released.empty()) return next++;
+            size_t slot = released.back();
+            released.pop_back();
+            return slot;
+        }
+
+        void release(size_t slot) {
+            std::lock_guard<std::mutex> guard(mutex);
+            released.push_back(slot);
+        }
+};
+
+inline size_t thread_slot() {
+    struct holder {
+        size_t slot = thread_slot_registry::instance().acquire();
+        ~holder() { thread_slot_registry::instance().release(slot); }
+    };
+    static thread_local holder h;
+    return h.slot;
+}
+
+// One measured operation (e.g. "spsc_pipe put"). Every thread recording into
+// a probe gets its own histogram, allocated on its first record(); they are
+// only merged when the probe is reported. Threads past the first 256 live
+// ones share one more histogram behind a mutex. Live probes are kept in a
+// registry so report_latency() can find them.
+class latency_probe {
+    static constexpr size_t max_threads = 256;
+
+    std::string name;
+    std::unique_ptr<std::atomic<histogram*>[]> slots;
+    histogram overflow;
+    std::mutex overflow_mutex;
+
+    static std::mutex& registry_mutex() { static std::mutex m; return m; }
+    static std::vector<latency_probe*>& registry() { static std::vector<latency_probe*> r; return r; }
+
+    public:
+
+        latency_probe(std::string name) :
+            name(name),
+            slots(new std::atomic<histogram*>[max_threads])
+        {
+            for (size_t i = 0; i < max_threads; i++) slots[i].store(nullptr, std::memory_order_relaxed);
+
+            std::lock_guard<std::mutex> guard(registry_mutex());
+            registry().push_back(this);
+        }
+
+        ~latency_probe() {
+            {
+                std::lock_guard<std::mutex> guard(registry_mutex());
+                auto& r = registry();
+                r.erase(std::remove(r.begin(), r.end(), this), r.end());
+            }
+
+            for (size_t i = 0; i < max_threads; i++) delete slots[i].load();
+        }
+
+        latency_probe(latency_probe const&) = delete;
+        latency_probe& operator=(latency_probe const&) = delete;
+
+        void label(std::string const& new_name) { name = new_name; }
+        std::string const& label() const { return name; }
+
+        void record(uint64_t ns) {
+            size_t index = thread_slot();
+            if (index >= max_threads) {
+                std::lock_guard<std::mutex> guard(overflow_mutex);
+                overflow.record(ns);
+                return;
+            }
+
+            std::atomic<histogram*>& slot = slots[index];
+            histogram* h = slot.load(std::memory_order_acquire);
+            if (!h) {
+                histogram* fresh = new histogram();
+                if (slot.compare_exchange_strong(h, fresh, std::memory_order_acq_rel)) h = fresh;
+                else delete fresh;
+            }
+            h->record(ns);
+        }
+
+        // calls f on every live probe, holding the registry lock so none of
+        // them is destroyed meanwhile
+        template<typename F>
+        static void for_each(F f) {
+            std::lock_guard<std::mutex> guard(registry_mutex());
+            for (auto probe : registry()) f(*probe);
+        }
+
+        // merges every thread's histogram into res
+        void merge_into(histogram& res) const {
+            for (size_t i = 0; i < max_threads; i++) {
+                if (histogram* h = slots[i].load(std::memory_order_acquire)) res.merge(*h);
+            }
+            res.merge(overflow);
+        }
+};
+
+// Records the lifetime of the object into probe.
+class scoped_latency {
+    latency_probe& probe;
+    std::chrono::steady_clock::time_point start;
+
+    public:
+        scoped_latency(latency_probe& probe) :
+            probe(probe),
+            start(std::chrono::steady_clock::now()) {}
+
+        ~scoped_latency() {
+            probe.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        }
+};
+
+// waiter.wait(guard, pred) (a condition_variable or a wait strategy) or,
+// for lock-free pipes, waiter.wait(pred),
+// recording the time spent into probe if pred was not already satisfied.
+template<typename Wait, typename Lock, typename Pred>
+void timed_wait(Wait& waiter, Lock& guard, latency_probe& probe, Pred pred) {
+    if (pred()) return;
+
+    scoped_latency t(probe);
+    waiter.wait(guard, pred);
+}
+
+template<typename Wait, typename Pred>
+void timed_wait(Wait& waiter, latency_probe& probe, Pred pred) {
+    if (pred()) return;
+
+    scoped_latency t(probe);
+    waiter.wait(pred);
+}
+
+// Prints p50/p99/p99.9/max of every live probe that recorded anything.
+inline void report_latency() {
+    bool header = false;
+    latency_probe::for_each([&](latency_probe const& probe) {
+        histogram h;
+        probe.merge_into(h);
+        if (h.count() == 0) return;
+
+        if (!header) printf("%-28s %12s %10s %10s %10s %10s\n", "latency (ns)", "count", "p50", "p99", "p99.9", "max");
+        header = true;
+        printf("%-28s %12lu %10lu %10lu %10lu %10lu\n", probe.label().c_str(), h.count(),
+                h.percentile(50), h.percentile(99), h.percentile(99.9), h.max());
+    });
+}
+
+#else
+
+// Latency recording compiled out: every probe is empty and every call is a
+// no-op the optimizer removes. Build with -DIOPERF_LATENCY to enable.
+class latency_probe {
+    public:
+        latency_probe(char const*) {}
+        void label(std::string const&) {}
+        void record(uint64_t) {}
+};
+
+class scoped_latency {
+    public:
+        scoped_latency(latency_probe&) {}
+};
+
+template<typename Wait, typename Lock, typename Pred>
+void timed_wait(Wait& waiter, Lock& guard, latency_probe&, Pred pred) {
+    waiter.wait(guard, pred);
+}
+
+template<typename Wait, typename Pred>
+void timed_wait(Wait& waiter, latency_probe&, Pred pred) {
+    waiter.wait(pred);
+}
+
+inline void report_latency() {}
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "histogram.h"
+
+namespace ygg {
+
+// Open-loop load: a paced source emits fixed-size records on a schedule
+// that doesn't depend on how fast anything downstream is, and stamps each
+// record with the time it was meant to go out. Measuring latency from that
+// intended time rather than from when the record actually left keeps a
+// stalled pipeline from hiding the records it delayed (coordinated
+// omission).
+
+// At the start of every record.
+struct record_header {
+    uint64_t sequence;
+    uint64_t intended_ns;
+};
+
+inline uint64_t steady_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Sleeps until close to t, then spins, yielding so that a consumer sharing
+// the CPU isn't starved; returns early once stopped is set.
+inline void wait_until_ns(uint64_t t, std::atomic<bool> const& stopped) {
+    constexpr uint64_t spin_ns = 50000;
+    constexpr uint64_t slice_ns = 10000000;
+
+    uint64_t now = steady_ns();
+    while (now + spin_ns < t && !stopped) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(std::min(t - now - spin_ns, slice_ns)));
+        now = steady_ns();
+    }
+    while (steady_ns() < t && !stopped) std::this_thread::yield();
+}
+
+// Intended send times for records_per_s records a second, either evenly
+// spaced ("constant") or as a Poisson process ("poisson", exponentially
+// distributed gaps with the same mean). Times don't depend on when
+// next() is called, so falling behind never lowers the offered load.
+class arrival_schedule {
+    double interval_ns;
+    bool poisson;
+    std::mt19937_64 gen;
+    std::exponential_distribution<double> gap;
+    double next_ns;
+
+    public:
+        arrival_schedule(double records_per_s, std::string const& kind, uint64_t seed) :
+            interval_ns(1e9 / records_per_s),
+            poisson(kind == "poisson"),
+            gen(seed),
+            gap(1.0),
+            next_ns(0) {}
+
+        uint64_t next() {
+            if (next_ns == 0) next_ns = steady_ns();
+            uint64_t res = static_cast<uint64_t>(next_ns);
+            next_ns += poisson ? interval_ns * gap(gen) : interval_ns;
+            return res;
+        }
+};
+
+// Finds the records in a byte stream of record_size records and records,
+// for each, the time from its intended send time to the arrival of its
+// last byte. Headers may be split across calls. capture() reads the headers
+// of the next chunk before anything in front of the sink can rewrite them
+// in place; deliver() then stamps the records among the first n bytes of
+// that chunk once they have arrived.
+class record_tracker {
+    size_t record_size;
+    size_t offset;
+    record_header header;
+    record_header next_header;
+    std::vector<std::pair<size_t, uint64_t>> pending; // end in the chunk and intended time of each complete record
+    uint64_t records;
+    uint64_t first_ns;
+    uint64_t last_ns;
+    histogram latencies;
+
+    public:
+        record_tracker(size_t record_size) :
+            record_size(std::max(record_size, sizeof(record_header))),
+            offset(0),
+            records(0),
+            first_ns(0),
+            last_ns(0) {}
+
+        void capture(char const* data, size_t n) {
+            pending.clear();
+            next_header = header;
+
+            size_t pos = 0;
+            size_t off = offset;
+            while (pos < n) {
+                size_t count = std::min(n - pos, record_size - off);
+                if (off < sizeof(record_header)) {
+                    size_t part = std::min(count, sizeof(record_header) - off);
+                    std::memcpy(reinterpret_cast<char*>(&next_header) + off, data + pos, part);
+                }
+
+                off += count;
+                pos += count;
+
+                if (off == record_size) {
+                    pending.push_back({pos, next_header.intended_ns});
+                    off = 0;
+                }
+            }
+        }
+
+        void deliver(size_t n, uint64_t now_ns) {
+            for (auto const& record : pending) {
+                if (record.first > n) break;
+                latencies.record(now_ns > record.second ? now_ns - record.second : 0);
+                if (records == 0) first_ns = now_ns;
+                last_ns = now_ns;
+                records++;
+            }
+
+            // bytes of an open header past n are captured again with the rest
+            offset = (offset + n) % record_size;
+            header = next_header;
+        }
+
+        histogram const& latency() const { return latencies; }
+        uint64_t count() const { return records; }
+
+        // delivered records per second between the first and the last
+        double rate() const {
+            return last_ns > first_ns ? (records - 1) * 1e9 / (last_ns - first_ns) : 0;
+        }
+};
+
+}
+
+#endif
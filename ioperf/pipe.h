@@ -2,146 +2,301 @@
 #define PIPE_H
 
 #include <cstring>
+#include <cstdint>
 #include <cassert>
 #include <cstdio>
 #include <mutex>
 #include <condition_variable>
 #include <algorithm>
-#include <array>
-
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "util.h"
+#include "arena.h"
+#include "histogram.h"
+#include "wait.h"
 #include "source.h"
 #include "sink.h"
 
 namespace ygg {
 
-class pipe : public source, public sink {};
+// Besides the copying put/get, every pipe offers in-place access to its
+// buffer: a writer reserve()s a contiguous region, fills it and commit()s
+// what it wrote; a reader peek()s at the readable region and consume()s what
+// it used. Only one reservation (and one peek) may be outstanding at a time.
+//
+// The concrete pipes take the strategy they wait with when full or empty
+// (see wait.h) as their last template parameter. The mutex-based pipes
+// block by default, the lock-free ones yield.
+class pipe : public source, public sink {
+    public:
+        virtual span<char> reserve(size_t n) = 0;
+        virtual void commit(size_t n) = 0;
+        virtual span<char> peek() = 0;
+        virtual void consume(size_t n) = 0;
+
+        // Like reserve() and peek(), but a ring pipe also hands out the part
+        // that wraps around to the start of its buffer; segs needs room for
+        // two. Returns the number of segments, and commit() and consume()
+        // take the total over all of them.
+        virtual size_t reserve_segments(size_t n, span<char>* segs) {
+            segs[0] = reserve(n);
+            return segs[0].size > 0 ? 1 : 0;
+        }
+
+        virtual size_t peek_segments(span<char>* segs) {
+            segs[0] = peek();
+            return segs[0].size > 0 ? 1 : 0;
+        }
 
-template<typename WordType, size_t Capacity>
+        virtual void stop() override = 0;
+};
+
+template<typename WordType, size_t Capacity, typename Wait = block_wait>
 class sized_pipe : public pipe {
-    std::array<WordType, Capacity> buf;
+    arena_buffer<WordType> buf;
     size_t write_idx;
     size_t read_idx;
+    bool reserved;
     bool stopped;
 
-    std::condition_variable cv;
+    Wait waiter;
     std::mutex buf_mutex;
 
+    latency_probe put_latency;
+    latency_probe get_latency;
+    latency_probe full_wait;
+    latency_probe empty_wait;
+
     public:
         sized_pipe() : 
+            buf(Capacity),
             write_idx(0), 
             read_idx(0), 
-            stopped(false) {}
+            reserved(false),
+            stopped(false),
+            put_latency("sized_pipe put"),
+            get_latency("sized_pipe get"),
+            full_wait("sized_pipe full wait"),
+            empty_wait("sized_pipe empty wait") {}
 
         virtual size_t put(WordType* src, std::streamsize n) override {
+            scoped_latency t(put_latency);
             std::unique_lock<std::mutex> guard(buf_mutex);
-            cv.wait(guard, [this]{return (this->write_idx < Capacity) || stopped;});
+            timed_wait(waiter, guard, full_wait, [this]{return (this->write_idx < Capacity) || stopped;});
 
             size_t count = std::min<long>(Capacity - write_idx, n);
             std::copy(src, src + count, buf.data() + write_idx);
             write_idx += count;
             
             guard.unlock();
-            cv.notify_one();
+            waiter.notify();
 
             return count;
         }
 
         virtual size_t get(char* dst, std::streamsize n) override {
+            scoped_latency t(get_latency);
             std::unique_lock<std::mutex> guard(buf_mutex);
-            cv.wait(guard, [this]{return (this->read_idx < this->write_idx) || stopped;});
+            timed_wait(waiter, guard, empty_wait, [this]{return (this->read_idx < this->write_idx) || stopped;});
 
             size_t count = std::min<long>(write_idx - read_idx, n);
             std::copy(buf.data() + read_idx, buf.data() + read_idx + count, dst);
             read_idx += count;
-            if (read_idx == write_idx) read_idx = write_idx = 0;
+            if (read_idx == write_idx && !reserved) read_idx = write_idx = 0;
 
             guard.unlock();
-            cv.notify_one();
+            waiter.notify();
 
             return count;
         }
 
+        virtual span<char> reserve(size_t n) override {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            timed_wait(waiter, guard, full_wait, [this]{return (this->write_idx < Capacity) || stopped;});
+
+            reserved = true;
+            return {reinterpret_cast<char*>(buf.data() + write_idx), std::min(Capacity - write_idx, n)};
+        }
+
+        virtual void commit(size_t n) override {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            write_idx += n;
+            reserved = false;
+            if (read_idx == write_idx) read_idx = write_idx = 0;
+
+            guard.unlock();
+            waiter.notify();
+        }
+
+        virtual span<char> peek() override {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            timed_wait(waiter, guard, empty_wait, [this]{return (this->read_idx < this->write_idx) || stopped;});
+
+            return {reinterpret_cast<char*>(buf.data() + read_idx), write_idx - read_idx};
+        }
+
+        virtual void consume(size_t n) override {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            read_idx += n;
+            if (read_idx == write_idx && !reserved) read_idx = write_idx = 0;
+
+            guard.unlock();
+            waiter.notify();
+        }
+
         virtual void stop() override {
-            stopped = true;
-            cv.notify_all();
+            {
+                std::lock_guard<std::mutex> guard(buf_mutex);
+                stopped = true;
+            }
+            waiter.notify_all();
         }
 };
 
-template<size_t Capacity>
+template<size_t Capacity, typename Wait = block_wait>
 class fixed_pipe : public pipe {
-    std::array<char, Capacity> buf;
+    arena_buffer<char> buf;
     size_t write_idx;
     size_t read_idx;
+    bool reserved;
     bool stopped;
 
-    std::condition_variable cv;
+    Wait waiter;
     std::mutex buf_mutex;
 
+    latency_probe put_latency;
+    latency_probe get_latency;
+    latency_probe full_wait;
+    latency_probe empty_wait;
+
     public:
         fixed_pipe() : 
+            buf(Capacity),
             write_idx(0), 
             read_idx(0), 
-            stopped(false) {}
+            reserved(false),
+            stopped(false),
+            put_latency("fixed_pipe put"),
+            get_latency("fixed_pipe get"),
+            full_wait("fixed_pipe full wait"),
+            empty_wait("fixed_pipe empty wait") {}
 
         virtual size_t put(char* src, std::streamsize n) override {
+            scoped_latency t(put_latency);
             std::unique_lock<std::mutex> guard(buf_mutex);
-            cv.wait(guard, [this]{return (this->write_idx < Capacity) || stopped;});
+            timed_wait(waiter, guard, full_wait, [this]{return (this->write_idx < Capacity) || stopped;});
 
             size_t count = std::min<long>(Capacity - write_idx, n);
             std::copy(src, src + count, buf.data() + write_idx);
             write_idx += count;
             
             guard.unlock();
-            cv.notify_one();
+            waiter.notify();
 
             return count;
         }
 
         virtual size_t get(char* dst, std::streamsize n) override {
+            scoped_latency t(get_latency);
             std::unique_lock<std::mutex> guard(buf_mutex);
-            cv.wait(guard, [this]{return (this->read_idx < this->write_idx) || stopped;});
+            timed_wait(waiter, guard, empty_wait, [this]{return (this->read_idx < this->write_idx) || stopped;});
 
             size_t count = std::min<long>(write_idx - read_idx, n);
             std::copy(buf.data() + read_idx, buf.data() + read_idx + count, dst);
             read_idx += count;
-            if (read_idx == write_idx) read_idx = write_idx = 0;
+            if (read_idx == write_idx && !reserved) read_idx = write_idx = 0;
 
             guard.unlock();
-            cv.notify_one();
+            waiter.notify();
 
             return count;
         }
 
+        virtual span<char> reserve(size_t n) override {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            timed_wait(waiter, guard, full_wait, [this]{return (this->write_idx < Capacity) || stopped;});
+
+            reserved = true;
+            return {reinterpret_cast<char*>(buf.data() + write_idx), std::min(Capacity - write_idx, n)};
+        }
+
+        virtual void commit(size_t n) override {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            write_idx += n;
+            reserved = false;
+            if (read_idx == write_idx) read_idx = write_idx = 0;
+
+            guard.unlock();
+            waiter.notify();
+        }
+
+        virtual span<char> peek() override {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            timed_wait(waiter, guard, empty_wait, [this]{return (this->read_idx < this->write_idx) || stopped;});
+
+            return {reinterpret_cast<char*>(buf.data() + read_idx), write_idx - read_idx};
+        }
+
+        virtual void consume(size_t n) override {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            read_idx += n;
+            if (read_idx == write_idx && !reserved) read_idx = write_idx = 0;
+
+            guard.unlock();
+            waiter.notify();
+        }
+
         virtual void stop() override {
-            stopped = true;
-            cv.notify_all();
+            {
+                std::lock_guard<std::mutex> guard(buf_mutex);
+                stopped = true;
+            }
+            waiter.notify_all();
         }
 };
 
+template<typename Wait = block_wait>
 class circular_pipe : public pipe {
-    char* buf;
+    arena_buffer<char> buf;
     size_t capacity;
     size_t write_idx;
     size_t read_idx;
     bool stopped;
 
-    std::condition_variable cv;
+    Wait waiter;
     std::mutex buf_mutex;
 
+    latency_probe put_latency;
+    latency_probe get_latency;
+    latency_probe full_wait;
+    latency_probe empty_wait;
+
+    // one slot stays empty so that a full ring can be told apart from an empty one
+    size_t contiguous_free() const {
+        if (write_idx >= read_idx) return capacity - write_idx - (read_idx == 0);
+        return read_idx - 1 - write_idx;
+    }
+
     public:
         circular_pipe(size_t capacity) : 
+            buf(capacity),
             capacity(capacity), 
             write_idx(0), 
             read_idx(0), 
-            buf(new char[capacity]),
-            stopped(false) {}
-        virtual ~circular_pipe() { delete[] buf; }
-
-
+            stopped(false),
+            put_latency("circular_pipe put"),
+            get_latency("circular_pipe get"),
+            full_wait("circular_pipe full wait"),
+            empty_wait("circular_pipe empty wait") {}
 
         virtual size_t put(char* src, std::streamsize n) override {
+            scoped_latency t(put_latency);
             std::unique_lock<std::mutex> guard(buf_mutex);
-            cv.wait(guard, [this]{return (this->write_idx + 1 != this->read_idx) || stopped;});
+            timed_wait(waiter, guard, full_wait, [this]{return (this->write_idx + 1 != this->read_idx) || stopped;});
 
             size_t total_count = 0;
 
@@ -150,7 +305,7 @@ class circular_pipe : public pipe {
             if (write_idx >= read_idx) {
                 size_t count = std::min<size_t>(capacity - write_idx - (read_idx == 0), n);
                 assert(write_idx + count <= capacity - (read_idx == 0));
-                std::memcpy(buf + write_idx, src, count);
+                std::memcpy(buf.data() + write_idx, src, count);
                 write_idx += count;
                 total_count += count;
                 n -= count;
@@ -161,7 +316,7 @@ class circular_pipe : public pipe {
             if (n > 0 && write_idx + 1 < read_idx) {
                 size_t count = std::min<size_t>(read_idx - 1 - write_idx, n);
                 assert(write_idx + count < capacity);
-                std::memcpy(buf + write_idx, src + total_count, count);
+                std::memcpy(buf.data() + write_idx, src + total_count, count);
                 write_idx += count;
                 total_count += count;
             }
@@ -169,20 +324,21 @@ class circular_pipe : public pipe {
             //printf(" did %8ld\n", total_count);
             
             guard.unlock();
-            cv.notify_one();
+            waiter.notify();
 
             return total_count;
         }
 
         virtual size_t get(char* dst, std::streamsize n) override {
+            scoped_latency t(get_latency);
             std::unique_lock<std::mutex> guard(buf_mutex);
-            cv.wait(guard, [this]{return (this->read_idx != this->write_idx) || stopped;});
+            timed_wait(waiter, guard, empty_wait, [this]{return (this->read_idx != this->write_idx) || stopped;});
 
             size_t total_count = 0;
 
             if (read_idx > write_idx) {
                 size_t count = std::min<size_t>(capacity - read_idx, n);
-                std::memcpy(dst, buf + read_idx, count);
+                std::memcpy(dst, buf.data() + read_idx, count);
                 read_idx += count;
                 total_count += count;
                 n -= count;
@@ -192,7 +348,7 @@ class circular_pipe : public pipe {
 
             if (n > 0 && read_idx < write_idx) {
                 size_t count = std::min<size_t>(write_idx - read_idx, n);
-                std::memcpy(dst + total_count, buf + read_idx, count);
+                std::memcpy(dst + total_count, buf.data() + read_idx, count);
                 read_idx += count;
                 total_count += count;
             }
@@ -200,14 +356,417 @@ class circular_pipe : public pipe {
             //printf("get: %8ld\n", total_count);
 
             guard.unlock();
-            cv.notify_one();
+            waiter.notify();
 
             return total_count;
         }
 
+        virtual span<char> reserve(size_t n) override {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            timed_wait(waiter, guard, full_wait, [this]{return (this->contiguous_free() > 0) || stopped;});
+
+            return {buf.data() + write_idx, std::min(contiguous_free(), n)};
+        }
+
+        // Free space only grows while the lock is released, so a second
+        // look finds at least what reserve() saw.
+        virtual size_t reserve_segments(size_t n, span<char>* segs) override {
+            segs[0] = reserve(n);
+            if (segs[0].size == 0) return 0;
+
+            std::lock_guard<std::mutex> guard(buf_mutex);
+            if (write_idx + segs[0].size < capacity || read_idx == 0 || read_idx > write_idx) return 1;
+            segs[1] = {buf.data(), std::min(read_idx - 1, n - segs[0].size)};
+            return segs[1].size > 0 ? 2 : 1;
+        }
+
+        virtual void commit(size_t n) override {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            write_idx = (write_idx + n) % capacity;
+
+            guard.unlock();
+            waiter.notify();
+        }
+
+        virtual span<char> peek() override {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            timed_wait(waiter, guard, empty_wait, [this]{return (this->read_idx != this->write_idx) || stopped;});
+
+            return {buf.data() + read_idx, (read_idx > write_idx ? capacity : write_idx) - read_idx};
+        }
+
+        virtual size_t peek_segments(span<char>* segs) override {
+            segs[0] = peek();
+            if (segs[0].size == 0) return 0;
+
+            std::lock_guard<std::mutex> guard(buf_mutex);
+            if (read_idx + segs[0].size < capacity || write_idx == 0) return 1;
+            segs[1] = {buf.data(), write_idx};
+            return 2;
+        }
+
+        virtual void consume(size_t n) override {
+            std::unique_lock<std::mutex> guard(buf_mutex);
+            read_idx = (read_idx + n) % capacity;
+
+            guard.unlock();
+            waiter.notify();
+        }
+
+        virtual void stop() override {
+            {
+                std::lock_guard<std::mutex> guard(buf_mutex);
+                stopped = true;
+            }
+            waiter.notify_all();
+        }
+};
+
+// Lock-free single-producer/single-consumer ring. Indices increase
+// monotonically and are masked on access, so capacity is rounded up to a
+// power of two. Each side keeps a cached copy of the other side's index and
+// only reloads it when the cached value says the ring is full (or empty).
+template<typename Wait = yield_wait>
+class spsc_pipe : public pipe {
+    arena_buffer<char> buf;
+    size_t capacity;
+    size_t mask;
+
+    // producer-owned
+    alignas(cache_line_size) std::atomic<size_t> write_idx;
+    size_t cached_read_idx;
+
+    // consumer-owned
+    alignas(cache_line_size) std::atomic<size_t> read_idx;
+    size_t cached_write_idx;
+
+    alignas(cache_line_size) std::atomic<bool> stopped;
+    Wait waiter;
+
+    latency_probe put_latency;
+    latency_probe get_latency;
+    latency_probe full_wait;
+    latency_probe empty_wait;
+
+    public:
+        spsc_pipe(size_t capacity) :
+            buf(next_pow2(capacity)),
+            capacity(next_pow2(capacity)),
+            mask(next_pow2(capacity) - 1),
+            write_idx(0),
+            cached_read_idx(0),
+            read_idx(0),
+            cached_write_idx(0),
+            stopped(false),
+            put_latency("spsc_pipe put"),
+            get_latency("spsc_pipe get"),
+            full_wait("spsc_pipe full wait"),
+            empty_wait("spsc_pipe empty wait") {}
+
+        virtual size_t put(char* src, std::streamsize n) override {
+            scoped_latency t(put_latency);
+            size_t w = write_idx.load(std::memory_order_relaxed);
+
+            if (capacity - (w - cached_read_idx) < static_cast<size_t>(n)) {
+                cached_read_idx = read_idx.load(std::memory_order_acquire);
+            }
+            if (w - cached_read_idx == capacity) {
+                timed_wait(waiter, full_wait, [&]{
+                    cached_read_idx = read_idx.load(std::memory_order_acquire);
+                    return w - cached_read_idx != capacity || stopped.load(std::memory_order_relaxed);
+                });
+                if (w - cached_read_idx == capacity) return 0;
+            }
+
+            size_t count = std::min<size_t>(capacity - (w - cached_read_idx), n);
+            size_t offset = w & mask;
+            size_t first = std::min(count, capacity - offset);
+            std::memcpy(buf.data() + offset, src, first);
+            std::memcpy(buf.data(), src + first, count - first);
+
+            write_idx.store(w + count, std::memory_order_release);
+            waiter.notify();
+
+            return count;
+        }
+
+        virtual size_t get(char* dst, std::streamsize n) override {
+            scoped_latency t(get_latency);
+            size_t r = read_idx.load(std::memory_order_relaxed);
+
+            if (cached_write_idx - r < static_cast<size_t>(n)) {
+                cached_write_idx = write_idx.load(std::memory_order_acquire);
+            }
+            if (cached_write_idx == r) {
+                timed_wait(waiter, empty_wait, [&]{
+                    cached_write_idx = write_idx.load(std::memory_order_acquire);
+                    return cached_write_idx != r || stopped.load(std::memory_order_relaxed);
+                });
+                if (cached_write_idx == r) return 0;
+            }
+
+            size_t count = std::min<size_t>(cached_write_idx - r, n);
+            size_t offset = r & mask;
+            size_t first = std::min(count, capacity - offset);
+            std::memcpy(dst, buf.data() + offset, first);
+            std::memcpy(dst + first, buf.data(), count - first);
+
+            read_idx.store(r + count, std::memory_order_release);
+            waiter.notify();
+
+            return count;
+        }
+
+        virtual span<char> reserve(size_t n) override {
+            size_t w = write_idx.load(std::memory_order_relaxed);
+
+            if (w - cached_read_idx == capacity) {
+                cached_read_idx = read_idx.load(std::memory_order_acquire);
+            }
+            if (w - cached_read_idx == capacity) {
+                timed_wait(waiter, full_wait, [&]{
+                    cached_read_idx = read_idx.load(std::memory_order_acquire);
+                    return w - cached_read_idx != capacity || stopped.load(std::memory_order_relaxed);
+                });
+                if (w - cached_read_idx == capacity) return {buf.data(), 0};
+            }
+
+            size_t offset = w & mask;
+            size_t count = std::min(capacity - (w - cached_read_idx), capacity - offset);
+            return {buf.data() + offset, std::min(count, n)};
+        }
+
+        virtual size_t reserve_segments(size_t n, span<char>* segs) override {
+            segs[0] = reserve(n);
+            if (segs[0].size == 0) return 0;
+
+            size_t free = capacity - (write_idx.load(std::memory_order_relaxed) - cached_read_idx);
+            segs[1] = {buf.data(), std::min(free, n) - segs[0].size};
+            return segs[1].size > 0 ? 2 : 1;
+        }
+
+        virtual void commit(size_t n) override {
+            write_idx.store(write_idx.load(std::memory_order_relaxed) + n, std::memory_order_release);
+            waiter.notify();
+        }
+
+        virtual span<char> peek() override {
+            size_t r = read_idx.load(std::memory_order_relaxed);
+
+            if (cached_write_idx == r) {
+                cached_write_idx = write_idx.load(std::memory_order_acquire);
+            }
+            if (cached_write_idx == r) {
+                timed_wait(waiter, empty_wait, [&]{
+                    cached_write_idx = write_idx.load(std::memory_order_acquire);
+                    return cached_write_idx != r || stopped.load(std::memory_order_relaxed);
+                });
+                if (cached_write_idx == r) return {buf.data(), 0};
+            }
+
+            size_t offset = r & mask;
+            return {buf.data() + offset, std::min(cached_write_idx - r, capacity - offset)};
+        }
+
+        virtual size_t peek_segments(span<char>* segs) override {
+            segs[0] = peek();
+            if (segs[0].size == 0) return 0;
+
+            segs[1] = {buf.data(), cached_write_idx - read_idx.load(std::memory_order_relaxed) - segs[0].size};
+            return segs[1].size > 0 ? 2 : 1;
+        }
+
+        virtual void consume(size_t n) override {
+            read_idx.store(read_idx.load(std::memory_order_relaxed) + n, std::memory_order_release);
+            waiter.notify();
+        }
+
+        virtual void stop() override {
+            stopped = true;
+            waiter.notify_all();
+        }
+};
+
+// Bounded multi-producer/multi-consumer queue of whole chunks (after
+// Vyukov's bounded MPMC queue). A put() moves up to chunk_size bytes into one
+// slot and a get() hands back exactly one slot, so the boundaries of what
+// producers put are kept no matter how many threads are on either side.
+// get() must therefore be given room for a whole chunk.
+//
+// reserve()/commit() and peek()/consume() claim a slot for the calling
+// thread, kept per pipe so that one thread can drive several chunk pipes.
+// peek() keeps handing out the rest of its slot until consume() has taken
+// all of it, and only then releases the slot.
+template<typename Wait = yield_wait>
+class chunk_pipe : public pipe {
+    // padded so that threads on neighbouring slots don't share a line
+    struct slot {
+        std::atomic<size_t> sequence;
+        size_t size;
+        char pad[cache_line_size - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+    };
+
+    arena_buffer<char> buf;
+    std::unique_ptr<slot[]> slots;
+    size_t chunk_size;
+    size_t mask;
+    uint64_t id; // tells pipes apart even when one is allocated where another was
+
+    alignas(cache_line_size) std::atomic<size_t> enqueue_pos;
+    alignas(cache_line_size) std::atomic<size_t> dequeue_pos;
+    alignas(cache_line_size) std::atomic<bool> stopped;
+    Wait waiter;
+
+    latency_probe put_latency;
+    latency_probe get_latency;
+    latency_probe full_wait;
+    latency_probe empty_wait;
+
+    // the slots reserve() and peek() claimed on one thread, and how much
+    // of the peeked one was consumed
+    struct claims {
+        size_t reserved = SIZE_MAX;
+        size_t peeked = SIZE_MAX;
+        size_t consumed = 0;
+    };
+
+    claims& thread_claims() {
+        static thread_local std::vector<std::pair<uint64_t, claims>> table;
+        for (auto& entry : table) if (entry.first == id) return entry.second;
+        table.emplace_back(id, claims());
+        return table.back().second;
+    }
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> count(0);
+        return count++;
+    }
+
+    char* data(size_t pos) { return buf.data() + (pos & mask) * chunk_size; }
+
+    // Claims the next slot at claim_pos, or returns false if it isn't ready yet
+    bool try_claim(std::atomic<size_t>& claim_pos, size_t offset, size_t& pos) {
+        pos = claim_pos.load(std::memory_order_relaxed);
+        while (true) {
+            slot& s = slots[pos & mask];
+            intptr_t diff = static_cast<intptr_t>(s.sequence.load(std::memory_order_acquire)) - static_cast<intptr_t>(pos + offset);
+
+            if (diff == 0) {
+                if (claim_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) return true;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = claim_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Waits until a slot can be claimed, or returns false once stopped
+    bool claim(std::atomic<size_t>& claim_pos, size_t offset, size_t& pos, latency_probe& wait) {
+        bool claimed = false;
+        timed_wait(waiter, wait, [&]{
+            claimed = try_claim(claim_pos, offset, pos);
+            return claimed || stopped.load(std::memory_order_relaxed);
+        });
+        return claimed;
+    }
+
+    void publish(size_t pos, size_t n) {
+        slots[pos & mask].size = n;
+        slots[pos & mask].sequence.store(pos + 1, std::memory_order_release);
+        waiter.notify();
+    }
+
+    void release(size_t pos) {
+        slots[pos & mask].sequence.store(pos + mask + 1, std::memory_order_release);
+        waiter.notify();
+    }
+
+    public:
+        // slot_count is rounded up to a power of two
+        chunk_pipe(size_t slot_count, size_t chunk_size) :
+            buf(next_pow2(slot_count) * chunk_size),
+            slots(new slot[next_pow2(slot_count)]),
+            chunk_size(chunk_size),
+            mask(next_pow2(slot_count) - 1),
+            id(next_id()),
+            enqueue_pos(0),
+            dequeue_pos(0),
+            stopped(false),
+            put_latency("chunk_pipe put"),
+            get_latency("chunk_pipe get"),
+            full_wait("chunk_pipe full wait"),
+            empty_wait("chunk_pipe empty wait")
+        {
+            for (size_t i = 0; i <= mask; i++) slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        virtual size_t put(char* src, std::streamsize n) override {
+            scoped_latency t(put_latency);
+            size_t pos;
+            if (!claim(enqueue_pos, 0, pos, full_wait)) return 0;
+
+            size_t count = std::min<size_t>(chunk_size, n);
+            std::memcpy(data(pos), src, count);
+            publish(pos, count);
+
+            return count;
+        }
+
+        virtual size_t get(char* dst, std::streamsize n) override {
+            assert(static_cast<size_t>(n) >= chunk_size);
+            scoped_latency t(get_latency);
+
+            size_t pos;
+            if (!claim(dequeue_pos, 1, pos, empty_wait)) return 0;
+
+            size_t count = slots[pos & mask].size;
+            std::memcpy(dst, data(pos), count);
+            release(pos);
+
+            return count;
+        }
+
+        virtual span<char> reserve(size_t n) override {
+            claims& c = thread_claims();
+            if (!claim(enqueue_pos, 0, c.reserved, full_wait)) {
+                c.reserved = SIZE_MAX;
+                return {nullptr, 0};
+            }
+            return {data(c.reserved), std::min(chunk_size, n)};
+        }
+
+        virtual void commit(size_t n) override {
+            claims& c = thread_claims();
+            if (c.reserved != SIZE_MAX) publish(c.reserved, n);
+            c.reserved = SIZE_MAX;
+        }
+
+        virtual span<char> peek() override {
+            claims& c = thread_claims();
+            if (c.peeked == SIZE_MAX) {
+                if (!claim(dequeue_pos, 1, c.peeked, empty_wait)) {
+                    c.peeked = SIZE_MAX;
+                    return {nullptr, 0};
+                }
+                c.consumed = 0;
+            }
+            return {data(c.peeked) + c.consumed, slots[c.peeked & mask].size - c.consumed};
+        }
+
+        virtual void consume(size_t n) override {
+            claims& c = thread_claims();
+            if (c.peeked == SIZE_MAX) return;
+
+            c.consumed += n;
+            if (c.consumed < slots[c.peeked & mask].size) return;
+            release(c.peeked);
+            c.peeked = SIZE_MAX;
+        }
+
         virtual void stop() override {
             stopped = true;
-            cv.notify_all();
+            waiter.notify_all();
         }
 };
 
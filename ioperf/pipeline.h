@@ -0,0 +1,422 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <cstdio>
+#include <memory>
+#include <vector>
+#include <string>
+
+#include "config.h"
+#include "sampling.h"
+#include "util.h"
+#include "source.h"
+#include "sink.h"
+#include "pipe.h"
+#include "worker.h"
+#include "wait.h"
+#include "topology.h"
+#include "arena.h"
+#include "shm.h"
+#include "dag.h"
+
+namespace ygg {
+
+// Runtime factory for the virtual hierarchy.
+//
+//   source: random, prng, paced, file, fd, mmap, uring, block, unix, unix-dgram, tcp, udp
+//   pipe:   fixed, circular, spsc, mpmc, shm
+//   sink:   null, file, fd, mmap, uring, block, direct, unix, unix-dgram, tcp, udp
+//   worker: fixed, direct, vector, adaptive
+//
+// wait: default, spin, spin-futex, yield, block
+//
+// Adaptive consumers of an mpmc pipe never go below the pipe's chunk size,
+// since a chunk_pipe get() must take a whole chunk. vector workers are
+// direct workers that hand the source or sink both halves of a wrapped
+// ring region at once (readv/writev for fd endpoints). Any transform other
+// than none wraps the sink in a transform_sink, and a dedup chunk size
+// wraps that in a dedup_sink, so the transform sees the deduplicated
+// stream. Behind a paced source the sink is wrapped in a latency_sink as
+// well. Block sources split the container's blocks between the producers,
+// and consumer i > 0 writes to output_file.i. fixed_pipe capacities are
+// rounded up to a power of two between 64 KiB and 64 MiB.
+
+inline bool is_socket(std::string const& kind) {
+    return kind == "unix" || kind == "unix-dgram" || kind == "tcp" || kind == "udp";
+}
+
+inline socket_options make_socket_options(pipeline_config const& config, std::string const& kind) {
+    socket_options res;
+    res.kind = kind;
+    res.buffer_size = config.socket_buffer;
+    res.batch = config.socket_batch;
+    res.datagram_size = config.datagram_size;
+    res.zerocopy = config.zerocopy;
+    return res;
+}
+
+// index tells the producers apart, so each prng source gets its own seed
+// and each block source its own range of blocks
+inline std::shared_ptr<source> make_source(pipeline_config const& config, size_t index = 0) {
+    char const* filename = config.input_file.c_str();
+
+    if (config.source == "file") return std::make_shared<file_source>(filename);
+    if (config.source == "fd") return std::make_shared<fd_file_source>(filename);
+    if (config.source == "mmap") return std::make_shared<mmap_file_source>(filename);
+    if (config.source == "uring") return std::make_shared<uring_file_source>(filename, config.queue_depth);
+    if (config.source == "block") return std::make_shared<block_file_source>(filename, index, config.producers);
+    if (is_socket(config.source)) return std::make_shared<socket_source>(make_socket_options(config, config.source));
+    if (config.source == "paced") return std::make_shared<paced_source>(parse_size(config.rate), config.record_size, config.arrival, config.seed ? config.seed + index : 1);
+    if (config.source == "prng") return make_aligned<random_source>(config.seed ? config.seed + index : 0);
+    return std::make_shared<random_buf_source<1*1024*1024> >();
+}
+
+inline std::shared_ptr<sink> make_plain_sink(pipeline_config const& config) {
+    char const* filename = config.output_file.c_str();
+
+    if (config.sink == "file") return std::make_shared<file_sink>(filename);
+    if (config.sink == "fd") return std::make_shared<fd_file_sink>(filename);
+    if (config.sink == "mmap") return std::make_shared<mmap_file_sink>(filename);
+    if (config.sink == "uring") return std::make_shared<uring_file_sink>(filename, config.queue_depth);
+    if (config.sink == "block") return std::make_shared<block_file_sink>(filename, config.block_size);
+    if (is_socket(config.sink)) return std::make_shared<socket_sink>(make_socket_options(config, config.sink));
+    if (config.sink == "direct") return std::make_shared<direct_file_sink>(filename, sync_policy::parse(config.sync_policy));
+    return std::make_shared<null_sink>();
+}
+
+// index tells the consumers apart, so consumer i > 0 writes to output_file.i
+// instead of truncating the file of consumer 0
+inline std::shared_ptr<sink> make_sink(pipeline_config const& config, size_t index = 0) {
+    if (index > 0) {
+        pipeline_config own = config;
+        own.output_file += "." + std::to_string(index);
+        return make_sink(own);
+    }
+
+    auto dst = make_plain_sink(config);
+    if (config.transform != "none") dst = std::make_shared<transform_sink>(dst, transform(config.transform, config.isa));
+    if (config.dedup != "off") dst = std::make_shared<dedup_sink>(dst, parse_size(config.dedup), config.isa);
+    if (config.source == "paced") dst = std::make_shared<latency_sink>(dst, config.record_size);
+    return dst;
+}
+
+// dst, or the first sink_stage it wraps, as a T
+template<typename T>
+std::shared_ptr<T> find_sink(std::shared_ptr<sink> dst) {
+    while (dst) {
+        if (auto res = std::dynamic_pointer_cast<T>(dst)) return res;
+        auto stage = std::dynamic_pointer_cast<sink_stage>(dst);
+        dst = stage ? stage->next() : nullptr;
+    }
+    return nullptr;
+}
+
+// nullptr if the pipe cannot serve the requested number of workers. The
+// mutex pipes keep track of one reservation and one peek only, so direct
+// and vector workers need them 1:1 as well.
+inline std::shared_ptr<pipe> make_pipe(pipeline_config const& config) {
+    bool single = config.producers == 1 && config.consumers == 1;
+    bool in_place = config.worker == "direct" || config.worker == "vector";
+    std::shared_ptr<pipe> res;
+
+    if (config.pipe == "circular") {
+        if (in_place && !single) return nullptr;
+        with_wait<block_wait>(config.wait, [&](auto wait) {
+            res = make_aligned<circular_pipe<typename decltype(wait)::type>>(config.pipe_capacity);
+        });
+    } else if (config.pipe == "spsc") {
+        if (!single) return nullptr;
+        with_wait<yield_wait>(config.wait, [&](auto wait) {
+            res = make_aligned<spsc_pipe<typename decltype(wait)::type>>(config.pipe_capacity);
+        });
+    } else if (config.pipe == "shm") {
+        if (!single) return nullptr;
+        res = make_aligned<shm_pipe>(config.pipe_capacity);
+    } else if (config.pipe == "mpmc") {
+        size_t slots = std::max<size_t>(config.pipe_capacity / config.chunk_size, 2);
+        with_wait<yield_wait>(config.wait, [&](auto wait) {
+            res = make_aligned<chunk_pipe<typename decltype(wait)::type>>(slots, config.chunk_size);
+        });
+    } else {
+        if (in_place && !single) return nullptr;
+        with_wait<block_wait>(config.wait, [&](auto wait) {
+            pow2_dispatch<64*1024, 64*1024*1024>::call(config.pipe_capacity, [&](auto capacity) {
+                res = make_aligned<fixed_pipe<decltype(capacity)::value, typename decltype(wait)::type>>();
+            });
+        });
+    }
+    return res;
+}
+
+// Pipelines that fan out to config.consumers branches or in from
+// config.producers sources (--dag):
+//
+//   tee            every branch gets the whole stream, from one shared ring
+//   split          whole chunks, dealt round robin over a pipe per branch
+//   split-hash     whole chunks, by a hash of their first bytes
+//   merge          every source into one mpmc pipe, in arrival order
+//   merge-ordered  a chunk from each source's own pipe in turn
+//
+// Branch i > 0 writes to output_file.i. Branches read their pipe in place
+// unless the transform modifies the data a tee's other branches still
+// see. Each worker moves data along one edge of the graph, so the sampling
+// table has a column per edge; the edges are listed below it. The producer
+// rate adds up the edges out of the sources, the consumer rate the edges
+// into the sinks.
+inline pipeline_result run_dag(pipeline_config const& config, bool print) {
+    bool merge = config.dag == "merge" || config.dag == "merge-ordered";
+    size_t sources = merge ? config.producers : 1;
+    size_t sinks = merge ? 1 : config.consumers;
+
+    placement where = make_placement(config.placement, config.cpus, config.mem_node, sources, sinks);
+    if (!where.error.empty()) {
+        if (print) printf("%s: skipped, %s placement %s\n", config.name().c_str(), config.placement.c_str(), where.error.c_str());
+        return {0, 0};
+    }
+    memory_binding binding(where);
+    buffer_arena::instance().set_mode(parse_page_mode(config.pages));
+
+    // the pipe of one edge, between a single writer and a single reader
+    pipeline_config edge = config;
+    edge.producers = edge.consumers = 1;
+
+    std::vector<std::shared_ptr<sink>> dsts;
+    for (size_t i = 0; i < sinks; i++) dsts.push_back(make_sink(config, i));
+
+    std::vector<std::shared_ptr<worker>> workers;
+    std::vector<std::string> edges;
+    if (config.dag == "tee") {
+        std::vector<std::shared_ptr<pipe>> branches;
+        with_wait<yield_wait>(config.wait, [&](auto wait) {
+            branches = make_tee<typename decltype(wait)::type>(config.pipe_capacity, sinks);
+        });
+
+        workers.push_back(make_aligned<fill_worker>(make_source(config), branches[0], config.chunk_size));
+        edges.push_back(config.source + " -> tee");
+        bool in_place = transform(config.transform, config.isa).read_only();
+        for (size_t i = 0; i < sinks; i++) {
+            if (in_place) workers.push_back(make_aligned<drain_worker>(branches[i], dsts[i]));
+            else workers.push_back(make_aligned<fixed_worker>(branches[i], dsts[i], config.chunk_size));
+            edges.push_back("tee -> " + config.sink + " " + std::to_string(i));
+        }
+    } else if (config.dag == "split" || config.dag == "split-hash") {
+        std::vector<std::shared_ptr<pipe>> pipes;
+        for (size_t i = 0; i < sinks; i++) pipes.push_back(make_pipe(edge));
+
+        auto policy = config.dag == "split" ? split_worker::round_robin : split_worker::hash;
+        workers.push_back(make_aligned<split_worker>(make_source(config), pipes, config.chunk_size, policy));
+        edges.push_back(config.source + " -> split");
+        for (size_t i = 0; i < sinks; i++) {
+            workers.push_back(make_aligned<drain_worker>(pipes[i], dsts[i]));
+            edges.push_back("split -> " + config.sink + " " + std::to_string(i));
+        }
+    } else if (config.dag == "merge") {
+        pipeline_config shared = config;
+        shared.pipe = "mpmc";
+        auto p = make_pipe(shared);
+
+        for (size_t i = 0; i < sources; i++) {
+            workers.push_back(make_aligned<fill_worker>(make_source(config, i), p, config.chunk_size));
+            edges.push_back(config.source + " " + std::to_string(i) + " -> merge");
+        }
+        workers.push_back(make_aligned<drain_worker>(p, dsts[0]));
+        edges.push_back("merge -> " + config.sink);
+    } else {
+        std::vector<std::shared_ptr<pipe>> inputs;
+        for (size_t i = 0; i < sources; i++) {
+            auto p = make_pipe(edge);
+            inputs.push_back(p);
+            workers.push_back(make_aligned<fill_worker>(make_source(config, i), p, config.chunk_size));
+            edges.push_back(config.source + " " + std::to_string(i) + " -> merge");
+        }
+        workers.push_back(make_aligned<merge_worker>(inputs, dsts[0], config.chunk_size));
+        edges.push_back("merge -> " + config.sink);
+    }
+
+    auto data = run(config.name(), workers, config.sample_count, print, where);
+    pipeline_result result{total_rate(data, 0, workers.size() - sinks),
+                           total_rate(data, workers.size() - sinks, workers.size())};
+
+    if (print) {
+        printf("edges:");
+        for (size_t w = 0; w < edges.size(); w++) printf(" w%zu %s%s", w + 1, edges[w].c_str(), w + 1 < edges.size() ? "," : "\n");
+        printf("sources: %9zu KiB/s, sinks: %9zu KiB/s\n", result.producer_rate, result.consumer_rate);
+        print_pages(parse_page_mode(config.pages));
+    }
+
+    for (size_t i = 0; i < sinks; i++) {
+        auto stage = find_sink<transform_sink>(dsts[i]);
+        if (print && stage && stage->transform().checksum()) {
+            printf("%s: %#018lx over %lu bytes (%s %zu)\n", stage->transform().name().c_str(),
+                    stage->transform().digest(), stage->transform().bytes(), config.sink.c_str(), i);
+        }
+    }
+    if (print) report_latency();
+
+    return result;
+}
+
+// Builds the pipeline described by config, runs it and returns the producer
+// and consumer throughput. Buffers allocated while building it follow the
+// placement's memory binding. Two fd endpoints are connected directly by a
+// kernel_copy_worker, without a pipe. With process "fork" the consumers run
+// in a child process on the far side of an shm_pipe. With a dag other than
+// none the graph is built by run_dag instead.
+inline pipeline_result run_pipeline(pipeline_config const& config, bool print = true) {
+    placement where = make_placement(config);
+    if (!where.error.empty()) {
+        if (print) printf("%s: skipped, %s placement %s\n", config.name().c_str(), config.placement.c_str(), where.error.c_str());
+        return {0, 0};
+    }
+    if (config.pipe == "shm" && config.wait != "default" && config.wait != "spin-futex") {
+        if (print) printf("%s: skipped, the shm pipe only waits with spin-futex\n", config.name().c_str());
+        return {0, 0};
+    }
+    if (config.source == "paced" && (config.producers > 1 || config.consumers > 1)) {
+        if (print) printf("%s: skipped, paced records only survive a 1:1 pipeline\n", config.name().c_str());
+        return {0, 0};
+    }
+    if (config.transform.find('+') != std::string::npos) {
+        if (print) printf("%s: skipped, chained transforms need --compose\n", config.name().c_str());
+        return {0, 0};
+    }
+    if (config.dag != "none") {
+        if (config.source == "paced" || config.process == "fork") {
+            if (print) printf("%s: skipped, dag pipelines take neither paced sources nor forked consumers\n", config.name().c_str());
+            return {0, 0};
+        }
+        return run_dag(config, print);
+    }
+    bool forked = config.process == "fork";
+    if (forked && config.pipe != "shm") {
+        if (print) printf("%s: skipped, forked consumers need the shm pipe\n", config.name().c_str());
+        return {0, 0};
+    }
+    memory_binding binding(where);
+    buffer_arena::instance().set_mode(parse_page_mode(config.pages));
+
+    // a forked consumer builds its sink in the child, see forked_worker
+    auto src = make_source(config);
+    auto dst = forked ? nullptr : make_sink(config);
+
+    if (dynamic_cast<fd_endpoint*>(src.get()) && dynamic_cast<fd_endpoint*>(dst.get())) {
+        auto w = make_aligned<kernel_copy_worker>(src, dst, config.chunk_size);
+        auto data = run("kernel_copy, " + config.source + " -> " + config.sink, {w}, config.sample_count, print, where);
+        if (print) printf("method: %s\n", w->method_name());
+        if (print) print_pages(parse_page_mode(config.pages));
+        if (print) report_latency();
+
+        size_t rate = total_rate(data, 0, 1);
+        return {rate, rate};
+    }
+
+    auto p = make_pipe(config);
+    if (!p) {
+        if (print) printf("%s: skipped, pipe does not support %zu:%zu workers\n", config.name().c_str(), config.producers, config.consumers);
+        return {0, 0};
+    }
+
+    size_t consumer_min = config.pipe == "mpmc" ? std::max(config.chunk_min, config.chunk_size) : config.chunk_min;
+
+    std::vector<std::shared_ptr<source>> srcs;
+    std::vector<std::shared_ptr<worker>> workers;
+    for (size_t i = 0; i < config.producers; i++) {
+        auto p_src = i == 0 ? src : make_source(config, i);
+        srcs.push_back(p_src);
+        if (config.worker == "direct" || config.worker == "vector") workers.push_back(make_aligned<fill_worker>(p_src, p, config.chunk_size, config.worker == "vector"));
+        else if (config.worker == "adaptive") workers.push_back(make_aligned<adaptive_worker>(p_src, p, config.chunk_size, config.chunk_min, config.chunk_max));
+        else workers.push_back(make_aligned<fixed_worker>(p_src, p, config.chunk_size));
+    }
+    for (size_t i = 0; i < config.consumers; i++) {
+        auto make_consumer = [=]() -> std::shared_ptr<worker> {
+            auto c_dst = dst && i == 0 ? dst : make_sink(config, i);
+            if (config.worker == "direct" || config.worker == "vector") return make_aligned<drain_worker>(p, c_dst, config.worker == "vector");
+            if (config.worker == "adaptive") return make_aligned<adaptive_worker>(p, c_dst, config.chunk_size, consumer_min, config.chunk_max);
+            return make_aligned<fixed_worker>(p, c_dst, config.chunk_size);
+        };
+        if (forked) workers.push_back(make_aligned<forked_worker>(make_consumer));
+        else workers.push_back(make_consumer());
+    }
+
+    std::string name = config.name();
+    if (config.sink == "direct") name += ", sync " + config.sync_policy;
+
+    auto data = run(name, workers, config.sample_count, print, where);
+    pipeline_result result{total_rate(data, 0, config.producers),
+                           total_rate(data, config.producers, config.producers + config.consumers)};
+
+    if (print && workers.size() > 2) {
+        printf("producers: %9zu KiB/s, consumers: %9zu KiB/s\n", result.producer_rate, result.consumer_rate);
+    }
+    if (print) print_pages(parse_page_mode(config.pages));
+
+    // with forked consumers the sinks' state stays in the child
+    auto stage = forked ? nullptr : find_sink<transform_sink>(dst);
+    if (stage) {
+        if (print && stage->transform().checksum()) {
+            printf("%s: %#018lx over %lu bytes (w%zu)\n", stage->transform().name().c_str(),
+                    stage->transform().digest(), stage->transform().bytes(), config.producers + 1);
+        } else if (print) {
+            printf("%s\n", stage->transform().name().c_str());
+        }
+    }
+
+    if (auto dedup = forked ? nullptr : find_sink<dedup_sink>(dst)) {
+        result.dedup_ratio = dedup->stats().ratio();
+        if (print) {
+            printf("dedup (%zu..%zu..%zu byte chunks): %s, index %zu of %zu slots\n", dedup->chunks().min_chunk(), dedup->chunks().avg_chunk(),
+                    dedup->chunks().max_chunk(), dedup->stats().str().c_str(), dedup->fingerprints().size(), dedup->fingerprints().capacity());
+        }
+    }
+
+    for (auto const& p_src : srcs) {
+        auto blocks = std::dynamic_pointer_cast<block_file_source>(p_src);
+        if (print && blocks) printf("%s\n", blocks->str().c_str());
+    }
+    auto blocks = forked ? nullptr : find_sink<block_file_sink>(dst);
+    if (print && blocks) printf("%s\n", blocks->str().c_str());
+
+    auto prng = std::dynamic_pointer_cast<random_source>(src);
+    if (print && prng) printf("prng (%s)\n", isa_name(prng->kernel()));
+    auto uring_src = std::dynamic_pointer_cast<uring_file_source>(src);
+    if (print && uring_src) printf("uring source: %s\n", uring_src->backend());
+    auto uring_dst = forked ? nullptr : find_sink<uring_file_sink>(dst);
+    if (print && uring_dst) printf("uring sink: %s\n", uring_dst->backend());
+
+    auto direct = forked ? nullptr : find_sink<direct_file_sink>(dst);
+    if (direct) {
+        sync_stats stats = direct->stats();
+        if (print) {
+            printf("fdatasync: %8lu calls, %8lu us mean, %8lu us max\n",
+                    stats.count, stats.count ? stats.total_us / stats.count : 0, stats.max_us);
+        }
+    }
+
+    if (auto endpoint = std::dynamic_pointer_cast<socket_endpoint>(src)) {
+        if (print) printf("%s\n", endpoint->socket_stats().c_str());
+    }
+    if (auto endpoint = forked ? nullptr : find_sink<socket_endpoint>(dst)) {
+        if (print) printf("%s\n", endpoint->socket_stats().c_str());
+    }
+
+    if (auto paced = forked ? nullptr : find_sink<latency_sink>(dst)) {
+        histogram const& h = paced->records().latency();
+        result.p50_ns = h.percentile(50);
+        result.p99_ns = h.percentile(99);
+        result.p999_ns = h.percentile(99.9);
+        if (print) {
+            printf("records: %lu at %.0f/s of %.0f/s offered\n", paced->records().count(), paced->records().rate(),
+                    parse_size(config.rate) / static_cast<double>(std::max<size_t>(config.record_size, sizeof(record_header))));
+            printf("%-28s %12s %10s %10s %10s %10s\n", "latency from intended (ns)", "count", "p50", "p99", "p99.9", "max");
+            printf("%-28s %12lu %10lu %10lu %10lu %10lu\n", "record", h.count(), result.p50_ns, result.p99_ns, result.p999_ns, h.max());
+        }
+    }
+
+    if (print) report_latency();
+
+    return result;
+}
+
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include <immintrin.h>
+
+#include "util.h"
+
+namespace ygg {
+
+inline uint64_t splitmix64(uint64_t& x) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Eight independent xoshiro256** generators run side by side; a block is
+// one output of each, lane i at bytes [8i, 8i + 8). The multiplications by
+// 5 and 9 are shifts and adds, so the AVX2 kernel needs no 64-bit multiply
+// and produces exactly what the scalar one does.
+class xoshiro_lanes {
+    static constexpr size_t lanes = 8;
+
+    public:
+        static constexpr size_t block_size = lanes * 8;
+
+    private:
+        alignas(32) uint64_t s[4][lanes];
+        isa level;
+        char spare[block_size];
+        size_t spare_idx;
+
+        static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+        void blocks_scalar(char* dst, size_t count) {
+            for (size_t b = 0; b < count; b++) {
+                uint64_t out[lanes];
+                for (size_t l = 0; l < lanes; l++) {
+                    uint64_t x = (s[1][l] << 2) + s[1][l];
+                    x = rotl(x, 7);
+                    out[l] = (x << 3) + x;
+
+                    uint64_t t = s[1][l] << 17;
+                    s[2][l] ^= s[0][l];
+                    s[3][l] ^= s[1][l];
+                    s[1][l] ^= s[2][l];
+                    s[0][l] ^= s[3][l];
+                    s[2][l] ^= t;
+                    s[3][l] = rotl(s[3][l], 45);
+                }
+                std::memcpy(dst + b * block_size, out, block_size);
+            }
+        }
+
+        __attribute__((target("avx2")))
+        void blocks_avx2(char* dst, size_t count) {
+            __m256i s0[2], s1[2], s2[2], s3[2];
+            for (size_t h = 0; h < 2; h++) {
+                s0[h] = _mm256_load_si256(reinterpret_cast<__m256i const*>(s[0] + 4 * h));
+                s1[h] = _mm256_load_si256(reinterpret_cast<__m256i const*>(s[1] + 4 * h));
+                s2[h] = _mm256_load_si256(reinterpret_cast<__m256i const*>(s[2] + 4 * h));
+                s3[h] = _mm256_load_si256(reinterpret_cast<__m256i const*>(s[3] + 4 * h));
+            }
+
+            for (size_t b = 0; b < count; b++) {
+                for (size_t h = 0; h < 2; h++) {
+                    __m256i x = _mm256_add_epi64(_mm256_slli_epi64(s1[h], 2), s1[h]);
+                    x = _mm256_or_si256(_mm256_slli_epi64(x, 7), _mm256_srli_epi64(x, 57));
+                    x = _mm256_add_epi64(_mm256_slli_epi64(x, 3), x);
+                    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + b * block_size + 32 * h), x);
+
+                    __m256i t = _mm256_slli_epi64(s1[h], 17);
+                    s2[h] = _mm256_xor_si256(s2[h], s0[h]);
+                    s3[h] = _mm256_xor_si256(s3[h], s1[h]);
+                    s1[h] = _mm256_xor_si256(s1[h], s2[h]);
+                    s0[h] = _mm256_xor_si256(s0[h], s3[h]);
+                    s2[h] = _mm256_xor_si256(s2[h], t);
+                    s3[h] = _mm256_or_si256(_mm256_slli_epi64(s3[h], 45), _mm256_srli_epi64(s3[h], 19));
+                }
+            }
+
+            for (size_t h = 0; h < 2; h++) {
+                _mm256_store_si256(reinterpret_cast<__m256i*>(s[0] + 4 * h), s0[h]);
+                _mm256_store_si256(reinterpret_cast<__m256i*>(s[1] + 4 * h), s1[h]);
+                _mm256_store_si256(reinterpret_cast<__m256i*>(s[2] + 4 * h), s2[h]);
+                _mm256_store_si256(reinterpret_cast<__m256i*>(s[3] + 4 * h), s3[h]);
+            }
+        }
+
+        void blocks(char* dst, size_t count) {
+            if (level == isa::avx2) blocks_avx2(dst, count);
+            else blocks_scalar(dst, count);
+        }
+
+    public:
+        xoshiro_lanes(uint64_t seed, isa level = detect_isa()) :
+            level(level),
+            spare_idx(block_size)
+        {
+            for (size_t l = 0; l < lanes; l++) {
+                for (size_t w = 0; w < 4; w++) s[w][l] = splitmix64(seed);
+            }
+        }
+
+        // The stream only depends on the seed, not on how it is split up
+        // into fill() calls.
+        void fill(char* dst, size_t n) {
+            size_t count = std::min(n, block_size - spare_idx);
+            std::memcpy(dst, spare + spare_idx, count);
+            spare_idx += count;
+            dst += count;
+            n -= count;
+
+            blocks(dst, n / block_size);
+            dst += n - n % block_size;
+            n %= block_size;
+
+            if (n > 0) {
+                blocks(spare, 1);
+                std::memcpy(dst, spare, n);
+                spare_idx = n;
+            }
+        }
+
+        isa kernel() const { return level == isa::avx2 ? isa::avx2 : isa::scalar; }
+};
+
+}
+
+#endif
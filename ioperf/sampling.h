@@ -0,0 +1,153 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include <cstdio>
+#include <string>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include "util.h"
+#include "counters.h"
+#include "topology.h"
+
+namespace ygg {
+
+using clock = std::chrono::high_resolution_clock;
+
+struct data_point {
+    clock::time_point time;
+    uint_fast64_t count;
+    size_t chunk_size = 0; // current transfer size, for workers that adapt it
+};
+
+// What run() drives. Only starting, polling and stopping go through the
+// vtable; the transfer loop inside work() is whatever the worker makes it.
+class worker {
+    public:
+        virtual ~worker() {}
+        virtual void work(std::string name) = 0;
+        virtual void poll(data_point& data) = 0;
+        virtual void stop() = 0;
+};
+
+// A worker's running total, polled by the sampler. Only the worker's own
+// thread adds to it, so a relaxed load and store stand in for a locked
+// read-modify-write, and it takes a cache line of its own so that neither
+// the worker's stores nor the sampler's loads touch the worker's hot fields.
+class alignas(cache_line_size) progress_counter {
+    std::atomic<uint64_t> value;
+
+    public:
+        progress_counter() :
+            value(0) {}
+
+        void add(uint64_t n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+        uint64_t load() const { return value.load(std::memory_order_relaxed); }
+};
+
+using samples = std::vector<std::vector<data_point>>;
+
+// Runs the workers on one thread each, samples them once per second and
+// prints the table. Up to two workers get the full per-worker columns;
+// wider runs print one KiB/s column per worker. Workers that adapt their
+// transfer size also report the size at each sample. Each worker thread's
+// counters are printed below the table. Each worker thread is placed by
+// where before it starts working.
+inline samples run(std::string const& name, std::vector<std::shared_ptr<worker>> const& workers,
+        size_t sample_count = 10, bool print = true, placement const& where = placement()) {
+    samples data(workers.size(), std::vector<data_point>(sample_count));
+
+    // Run
+    std::vector<counter_values> counters(workers.size());
+    std::vector<std::thread> threads;
+    for (size_t w = 0; w < workers.size(); w++) {
+        auto wp = workers[w];
+        auto& cv = counters[w];
+        threads.emplace_back([wp, w, &cv, &where] {
+            where.apply(w);
+            thread_counters tc;
+            wp->work("w" + std::to_string(w + 1));
+            cv = tc.read();
+        });
+    }
+
+    // Poll
+    clock::time_point start = clock::now();
+
+    for (size_t i = 0; i < sample_count; i++) {
+        std::this_thread::sleep_until(start + std::chrono::seconds(i + 1));
+        for (size_t w = 0; w < workers.size(); w++) workers[w]->poll(data[w][i]);
+    }
+
+    for (auto& w : workers) w->stop();
+    for (auto& t : threads) t.join();
+
+    if (!print) return data;
+
+    // Process
+    printf("%s\n", name.c_str());
+    if (where.pinned() || where.mem_node >= 0) printf("placement: %s\n", where.str().c_str());
+
+    bool wide = workers.size() > 2;
+    bool chunks = false;
+    for (auto const& points : data) chunks = chunks || points.back().chunk_size > 0;
+
+    if (wide) {
+        printf("%11s", "KiB/s");
+        for (size_t w = 0; w < workers.size(); w++) printf(chunks ? " %9s %6s" : " %9s", ("w" + std::to_string(w + 1)).c_str(), "chunk");
+        printf("\n");
+    }
+
+    for (size_t i = 0; i < sample_count; i++) {
+        for (size_t w = 0; w < workers.size(); w++) {
+            auto dur = std::chrono::duration_cast<std::chrono::microseconds>(data[w][i].time - start).count();
+
+            size_t delta = 0;
+            if (i > 0) {
+                delta = (data[w][i].count - data[w][i - 1].count) / 1024;
+            }
+
+            std::string chunk = data[w][i].chunk_size ? format_size(data[w][i].chunk_size) : "-";
+
+            if (!wide) {
+                printf("%s%8ld us: %11ld (%8ld KiB/s", w > 0 ? ", " : "", dur, data[w][i].count, delta);
+                if (chunks) printf(", chunk %6s", chunk.c_str());
+                printf(")");
+            } else {
+                if (w == 0) printf("%8ld us:", dur);
+                printf(" %9ld", delta);
+                if (chunks) printf(" %6s", chunk.c_str());
+            }
+        }
+        printf("\n");
+    }
+
+    std::vector<uint64_t> bytes(workers.size());
+    for (size_t w = 0; w < workers.size(); w++) {
+        data_point last;
+        workers[w]->poll(last);
+        bytes[w] = last.count;
+    }
+    print_counters(counters, bytes);
+
+    return data;
+}
+
+// Average KiB/s of workers [first, last) between the first and last sample.
+inline size_t total_rate(samples const& data, size_t first, size_t last) {
+    size_t bytes = 0;
+    double seconds = 0;
+    for (size_t w = first; w < last; w++) {
+        bytes += data[w].back().count - data[w].front().count;
+        seconds = std::max(seconds, std::chrono::duration<double>(data[w].back().time - data[w].front().time).count());
+    }
+    return seconds > 0 ? bytes / seconds / 1024 : 0;
+}
+
+}
+
+#endif
@@ -0,0 +1,344 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "histogram.h"
+#include "wait.h"
+#include "sampling.h"
+#include "pipe.h"
+
+namespace ygg {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+        "shared memory pipes need address-free atomics");
+
+// spsc_pipe with its indices and ring in a memfd segment, so the producer
+// and the consumer may be different processes: either side of a fork(), or
+// any process the segment's fd is passed to. Waiting sides park on a
+// process-shared futex. Everything process-local (the cached copy of the
+// other side's index) stays outside the segment.
+class shm_pipe : public pipe {
+    struct control {
+        alignas(cache_line_size) std::atomic<size_t> write_idx;
+        alignas(cache_line_size) std::atomic<size_t> read_idx;
+        alignas(cache_line_size) std::atomic<bool> stopped;
+        spin_futex_wait waiter;
+
+        control() :
+            write_idx(0),
+            read_idx(0),
+            stopped(false),
+            waiter(true) {}
+    };
+
+    static constexpr size_t data_offset = 4096;
+
+    int fd;
+    char* segment;
+    size_t segment_size;
+    control* ctl;
+    char* buf;
+    size_t capacity;
+    size_t mask;
+
+    size_t cached_read_idx;
+    size_t cached_write_idx;
+
+    latency_probe put_latency;
+    latency_probe get_latency;
+    latency_probe full_wait;
+    latency_probe empty_wait;
+
+    bool is_stopped() const { return ctl->stopped.load(std::memory_order_relaxed); }
+
+    public:
+        // capacity is rounded up to a power of two
+        shm_pipe(size_t capacity) :
+            fd(memfd_create("ioperf-shm-pipe", MFD_CLOEXEC)),
+            segment(nullptr),
+            segment_size(data_offset + next_pow2(capacity)),
+            ctl(nullptr),
+            buf(nullptr),
+            capacity(next_pow2(capacity)),
+            mask(next_pow2(capacity) - 1),
+            cached_read_idx(0),
+            cached_write_idx(0),
+            put_latency("shm_pipe put"),
+            get_latency("shm_pipe get"),
+            full_wait("shm_pipe full wait"),
+            empty_wait("shm_pipe empty wait")
+        {
+            static_assert(sizeof(control) <= data_offset, "shm_pipe control block overlaps the ring");
+
+            if (fd < 0 || ftruncate(fd, segment_size) != 0) throw std::runtime_error("shm_pipe: memfd");
+            void* p = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+            if (p == MAP_FAILED) throw std::runtime_error("shm_pipe: mmap");
+
+            segment = static_cast<char*>(p);
+            ctl = new (segment) control();
+            buf = segment + data_offset;
+        }
+
+        virtual ~shm_pipe() {
+            ctl->~control();
+            munmap(segment, segment_size);
+            close(fd);
+        }
+
+        shm_pipe(shm_pipe const&) = delete;
+        shm_pipe& operator=(shm_pipe const&) = delete;
+
+        // for handing the segment to an unrelated process
+        int segment_fd() const { return fd; }
+
+        virtual size_t put(char* src, std::streamsize n) override {
+            scoped_latency t(put_latency);
+            size_t w = ctl->write_idx.load(std::memory_order_relaxed);
+
+            if (capacity - (w - cached_read_idx) < static_cast<size_t>(n)) {
+                cached_read_idx = ctl->read_idx.load(std::memory_order_acquire);
+            }
+            if (w - cached_read_idx == capacity) {
+                timed_wait(ctl->waiter, full_wait, [&]{
+                    cached_read_idx = ctl->read_idx.load(std::memory_order_acquire);
+                    return w - cached_read_idx != capacity || is_stopped();
+                });
+                if (w - cached_read_idx == capacity) return 0;
+            }
+
+            size_t count = std::min<size_t>(capacity - (w - cached_read_idx), n);
+            size_t offset = w & mask;
+            size_t first = std::min(count, capacity - offset);
+            std::memcpy(buf + offset, src, first);
+            std::memcpy(buf, src + first, count - first);
+
+            ctl->write_idx.store(w + count, std::memory_order_release);
+            ctl->waiter.notify();
+
+            return count;
+        }
+
+        virtual size_t get(char* dst, std::streamsize n) override {
+            scoped_latency t(get_latency);
+            size_t r = ctl->read_idx.load(std::memory_order_relaxed);
+
+            if (cached_write_idx - r < static_cast<size_t>(n)) {
+                cached_write_idx = ctl->write_idx.load(std::memory_order_acquire);
+            }
+            if (cached_write_idx == r) {
+                timed_wait(ctl->waiter, empty_wait, [&]{
+                    cached_write_idx = ctl->write_idx.load(std::memory_order_acquire);
+                    return cached_write_idx != r || is_stopped();
+                });
+                if (cached_write_idx == r) return 0;
+            }
+
+            size_t count = std::min<size_t>(cached_write_idx - r, n);
+            size_t offset = r & mask;
+            size_t first = std::min(count, capacity - offset);
+            std::memcpy(dst, buf + offset, first);
+            std::memcpy(dst + first, buf, count - first);
+
+            ctl->read_idx.store(r + count, std::memory_order_release);
+            ctl->waiter.notify();
+
+            return count;
+        }
+
+        virtual span<char> reserve(size_t n) override {
+            size_t w = ctl->write_idx.load(std::memory_order_relaxed);
+
+            if (w - cached_read_idx == capacity) {
+                cached_read_idx = ctl->read_idx.load(std::memory_order_acquire);
+            }
+            if (w - cached_read_idx == capacity) {
+                timed_wait(ctl->waiter, full_wait, [&]{
+                    cached_read_idx = ctl->read_idx.load(std::memory_order_acquire);
+                    return w - cached_read_idx != capacity || is_stopped();
+                });
+                if (w - cached_read_idx == capacity) return {buf, 0};
+            }
+
+            size_t offset = w & mask;
+            size_t count = std::min(capacity - (w - cached_read_idx), capacity - offset);
+            return {buf + offset, std::min(count, n)};
+        }
+
+        virtual size_t reserve_segments(size_t n, span<char>* segs) override {
+            segs[0] = reserve(n);
+            if (segs[0].size == 0) return 0;
+
+            size_t free = capacity - (ctl->write_idx.load(std::memory_order_relaxed) - cached_read_idx);
+            segs[1] = {buf, std::min(free, n) - segs[0].size};
+            return segs[1].size > 0 ? 2 : 1;
+        }
+
+        virtual void commit(size_t n) override {
+            ctl->write_idx.store(ctl->write_idx.load(std::memory_order_relaxed) + n, std::memory_order_release);
+            ctl->waiter.notify();
+        }
+
+        virtual span<char> peek() override {
+            size_t r = ctl->read_idx.load(std::memory_order_relaxed);
+
+            if (cached_write_idx == r) {
+                cached_write_idx = ctl->write_idx.load(std::memory_order_acquire);
+            }
+            if (cached_write_idx == r) {
+                timed_wait(ctl->waiter, empty_wait, [&]{
+                    cached_write_idx = ctl->write_idx.load(std::memory_order_acquire);
+                    return cached_write_idx != r || is_stopped();
+                });
+                if (cached_write_idx == r) return {buf, 0};
+            }
+
+            size_t offset = r & mask;
+            return {buf + offset, std::min(cached_write_idx - r, capacity - offset)};
+        }
+
+        virtual size_t peek_segments(span<char>* segs) override {
+            segs[0] = peek();
+            if (segs[0].size == 0) return 0;
+
+            segs[1] = {buf, cached_write_idx - ctl->read_idx.load(std::memory_order_relaxed) - segs[0].size};
+            return segs[1].size > 0 ? 2 : 1;
+        }
+
+        virtual void consume(size_t n) override {
+            ctl->read_idx.store(ctl->read_idx.load(std::memory_order_relaxed) + n, std::memory_order_release);
+            ctl->waiter.notify();
+        }
+
+        // stops both processes' side of the pipe
+        virtual void stop() override {
+            ctl->stopped = true;
+            ctl->waiter.notify_all();
+        }
+};
+
+// Runs a worker in a child process, forked when the forked_worker is
+// constructed so that no other thread of the parent can be holding a lock
+// at the time. The worker, and with it its sink, is only built in the
+// child, and destroyed there before the child exits, so sinks that finish
+// their output on destruction (a flusher thread, a container index, the
+// final file size) do so in the process that wrote it. The child waits
+// until work() is called, takes over the CPU affinity of the thread that
+// called it and runs the worker there.
+// In the parent, poll() reports what the child publishes through a shared
+// page (refreshed every millisecond) and stop() makes the child stop its
+// worker and exit.
+//
+// The parent only ever sees the child through that page: thread counters
+// and latency histograms of a forked worker's row are those of the parent
+// thread waiting for it, and anything its source or sink accumulates stays
+// in the child.
+class forked_worker : public worker {
+    enum { idle, running, stopping };
+
+    struct shared_state {
+        std::atomic<uint32_t> phase;
+        std::atomic<uint64_t> bytes;
+        std::atomic<size_t> chunk_size;
+        cpu_set_t cpus;
+        spin_futex_wait started;
+
+        shared_state() :
+            phase(idle),
+            bytes(0),
+            chunk_size(0),
+            started(true) {}
+    };
+
+    shared_state* state;
+    pid_t child;
+
+    void publish(worker& w) {
+        data_point data;
+        w.poll(data);
+        state->bytes.store(data.count, std::memory_order_relaxed);
+        state->chunk_size.store(data.chunk_size, std::memory_order_relaxed);
+    }
+
+    // never returns
+    void child_main(std::function<std::shared_ptr<worker>()> const& make) {
+        std::shared_ptr<worker> w = make();
+        state->started.wait([&]{ return state->phase.load(std::memory_order_acquire) != idle; });
+
+        if (state->phase.load(std::memory_order_acquire) == running) {
+            sched_setaffinity(0, sizeof(state->cpus), &state->cpus);
+            std::thread t([&]{ w->work("forked"); });
+            while (state->phase.load(std::memory_order_acquire) == running) {
+                publish(*w);
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            w->stop();
+            t.join();
+            publish(*w);
+        }
+        w.reset();
+        _exit(0);
+    }
+
+    public:
+        forked_worker(std::function<std::shared_ptr<worker>()> make) :
+            state(nullptr),
+            child(-1)
+        {
+            void* p = mmap(nullptr, sizeof(shared_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) throw std::runtime_error("forked_worker: mmap");
+            state = new (p) shared_state();
+
+            fflush(stdout);
+            child = fork();
+            if (child < 0) throw std::runtime_error("forked_worker: fork");
+            if (child == 0) child_main(make);
+        }
+
+        virtual ~forked_worker() {
+            stop();
+            if (child > 0) waitpid(child, nullptr, 0);
+            state->~shared_state();
+            munmap(state, sizeof(shared_state));
+        }
+
+        virtual void work(std::string) override {
+            sched_getaffinity(0, sizeof(state->cpus), &state->cpus);
+
+            uint32_t expected = idle;
+            if (state->phase.compare_exchange_strong(expected, running, std::memory_order_release)) state->started.notify();
+            if (child > 0 && waitpid(child, nullptr, 0) == child) child = -1;
+        }
+
+        virtual void poll(data_point& data) override {
+            data.time = clock::now();
+            data.count = state->bytes.load(std::memory_order_relaxed);
+            data.chunk_size = state->chunk_size.load(std::memory_order_relaxed);
+        }
+
+        virtual void stop() override {
+            state->phase.store(stopping, std::memory_order_release);
+            state->started.notify_all();
+        }
+};
+
+}
+
+#endif
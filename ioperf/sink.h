@@ -3,6 +3,31 @@
 
 #include <ios>
 #include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "async_io.h"
+#include "socket.h"
+#include "transform.h"
+#include "pacing.h"
+#include "container.h"
+#include "dedup.h"
 
 namespace ygg {
 
@@ -10,6 +35,22 @@ class sink {
     public: 
         virtual size_t put(char* src, std::streamsize n) = 0; 
         virtual void stop() = 0;
+
+        // Writes count segments in order, stopping once put() takes nothing.
+        // Sinks that can gather in one call override this.
+        virtual size_t putv(span<char> const* segs, size_t count) {
+            size_t total = 0;
+            for (size_t i = 0; i < count; i++) {
+                size_t done = 0;
+                while (done < segs[i].size) {
+                    size_t n = put(segs[i].data + done, segs[i].size - done);
+                    if (n == 0) return total + done;
+                    done += n;
+                }
+                total += done;
+            }
+            return total;
+        }
 };
 
 class file_sink : public sink {
@@ -28,12 +69,635 @@ class file_sink : public sink {
         virtual void stop() override {}
 };
 
+// file_sink on a raw descriptor, see fd_file_source.
+class fd_file_sink : public sink, public fd_endpoint {
+    int file_fd;
+
+    public:
+        fd_file_sink(char const* filename) :
+            file_fd(open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644))
+        {
+            if (file_fd < 0) perror(filename);
+        }
+
+        virtual ~fd_file_sink() {
+            if (file_fd >= 0) close(file_fd);
+        }
+
+        virtual int fd() const override { return file_fd; }
+
+        virtual size_t put(char* src, std::streamsize n) override {
+            size_t total_count = 0;
+            while (total_count < static_cast<size_t>(n)) {
+                ssize_t count = write(file_fd, src + total_count, n - total_count);
+                if (count <= 0) break;
+                total_count += count;
+            }
+
+            return n;
+        }
+
+        // one writev() per call unless the kernel takes less than all of it
+        virtual size_t putv(span<char> const* segs, size_t count) override {
+            iovec iov[max_segments];
+            count = std::min(count, max_segments);
+            for (size_t i = 0; i < count; i++) iov[i] = {segs[i].data, segs[i].size};
+
+            size_t total = 0;
+            size_t first = 0;
+            while (first < count) {
+                ssize_t res = writev(file_fd, iov + first, count - first);
+                if (res <= 0) break;
+                total += res;
+
+                size_t left = res;
+                while (first < count && left >= iov[first].iov_len) left -= iov[first++].iov_len;
+                if (first < count) {
+                    iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+                    iov[first].iov_len -= left;
+                }
+            }
+            return total;
+        }
+
+        virtual void stop() override {}
+};
+
+// Writes through a sliding shared mapping: whenever the current window is
+// full, the file is grown by another window with ftruncate and the next
+// window is mapped. The file is cut back to the bytes actually written on
+// destruction.
+class mmap_file_sink : public sink {
+    int fd;
+    size_t window_size;
+    size_t window_offset;
+    size_t write_idx;
+    char* window;
+
+    void map_next() {
+        if (window) {
+            munmap(window, window_size);
+            window_offset += window_size;
+        }
+        window = nullptr;
+        write_idx = 0;
+
+        if (ftruncate(fd, window_offset + window_size) != 0) {
+            perror("ftruncate");
+            return;
+        }
+
+        void* addr = mmap(nullptr, window_size, PROT_WRITE, MAP_SHARED, fd, window_offset);
+        if (addr == MAP_FAILED) {
+            perror("mmap");
+            return;
+        }
+        window = static_cast<char*>(addr);
+    }
+
+    public:
+        // window_size must be a multiple of the page size
+        mmap_file_sink(char const* filename, size_t window_size = 64*1024*1024) :
+            fd(open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)),
+            window_size(window_size),
+            window_offset(0),
+            write_idx(0),
+            window(nullptr)
+        {
+            if (fd < 0) perror(filename);
+        }
+
+        virtual ~mmap_file_sink() {
+            if (window) munmap(window, window_size);
+            if (fd >= 0) {
+                if (ftruncate(fd, window_offset + write_idx) != 0) perror("ftruncate");
+                close(fd);
+            }
+        }
+
+        virtual size_t put(char* src, std::streamsize n) override {
+            if (fd < 0) return n;
+
+            size_t total_count = 0;
+            while (total_count < static_cast<size_t>(n)) {
+                if (!window || write_idx == window_size) {
+                    map_next();
+                    if (!window) break;
+                }
+
+                size_t count = std::min<size_t>(window_size - write_idx, n - total_count);
+                std::memcpy(window + write_idx, src + total_count, count);
+                write_idx += count;
+                total_count += count;
+            }
+
+            return n;
+        }
+
+        virtual void stop() override {}
+};
+
+// Keeps up to queue_depth block writes in flight through io_uring (or a
+// pwrite thread pool where io_uring is unavailable).
+class uring_file_sink : public sink {
+    async_writer writer;
+
+    public:
+        uring_file_sink(char const* filename, size_t queue_depth = 8, size_t block_size = 256*1024) :
+            writer(filename, queue_depth, block_size) {}
+
+        char const* backend() const { return writer.backend(); }
+
+        virtual size_t put(char* src, std::streamsize n) override {
+            return writer.write(src, n);
+        }
+
+        virtual void stop() override {}
+};
+
+// Writes an ioperf container (see container.h) for block_file_source to
+// read back. With a block size, every block but the last holds exactly
+// that many bytes, gathered from as many put()s as it takes; a put() of at
+// least a whole block into an empty buffer goes out without a copy. With
+// block size 0 every put() is a block of its own, as the worker chunked
+// it. The index is written when the sink is destroyed.
+class block_file_sink : public sink {
+    container_writer writer;
+    size_t block_size;
+    std::vector<char> buf;
+    size_t buf_size;
+
+    public:
+        block_file_sink(char const* filename, size_t block_size = 1024*1024) :
+            writer(filename, std::min(block_size, max_block_size)),
+            block_size(std::min(block_size, max_block_size)),
+            buf(this->block_size),
+            buf_size(0) {}
+
+        virtual ~block_file_sink() {
+            if (buf_size > 0) writer.append(buf.data(), buf_size);
+        }
+
+        virtual size_t put(char* src, std::streamsize n) override {
+            size_t total_count = 0;
+            while (total_count < static_cast<size_t>(n)) {
+                size_t left = n - total_count;
+                if (block_size == 0 || (buf_size == 0 && left >= block_size)) {
+                    size_t count = std::min(left, block_size ? block_size : max_block_size);
+                    if (!writer.append(src + total_count, count)) break;
+                    total_count += count;
+                    continue;
+                }
+
+                size_t count = std::min(left, block_size - buf_size);
+                std::memcpy(buf.data() + buf_size, src + total_count, count);
+                buf_size += count;
+                total_count += count;
+                if (buf_size == block_size) {
+                    if (!writer.append(buf.data(), buf_size)) break;
+                    buf_size = 0;
+                }
+            }
+
+            return n;
+        }
+
+        virtual void stop() override {}
+
+        std::string str() const {
+            return "block sink: " + std::to_string(writer.blocks()) + " blocks of " +
+                (block_size ? std::to_string(block_size) + " bytes" : "variable size") + ", " + std::to_string(writer.bytes()) + " bytes written";
+        }
+};
+
+// When direct_file_sink calls fdatasync: never, once at least every_bytes
+// have been written since the last sync, or once every_us has passed since
+// the last sync. Written as "never", "bytes:<N>" or "us:<T>".
+struct sync_policy {
+    enum kind_type { never, bytes, interval };
+
+    kind_type kind;
+    size_t every_bytes;
+    std::chrono::microseconds every_us;
+
+    static sync_policy parse(std::string const& spec) {
+        if (spec.compare(0, 6, "bytes:") == 0) return {bytes, std::stoul(spec.substr(6)), std::chrono::microseconds(0)};
+        if (spec.compare(0, 3, "us:") == 0) return {interval, 0, std::chrono::microseconds(std::stol(spec.substr(3)))};
+        return {never, 0, std::chrono::microseconds(0)};
+    }
+
+    std::string str() const {
+        if (kind == bytes) return "bytes:" + std::to_string(every_bytes);
+        if (kind == interval) return "us:" + std::to_string(every_us.count());
+        return "never";
+    }
+};
+
+struct sync_stats {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+};
+
+// Bypasses the page cache with O_DIRECT. put() fills one aligned buffer
+// while a flusher thread writes out the other, and the flusher applies the
+// sync_policy after each write, so a sync covers every block written since
+// the previous one (group commit). Falls back to buffered I/O on
+// filesystems that refuse O_DIRECT.
+class direct_file_sink : public sink {
+    static constexpr size_t alignment = 4096;
+
+    int fd;
+    size_t block_size;
+    sync_policy policy;
+
+    char* buffers[2];
+    size_t fill;
+    size_t write_idx;
+    size_t file_size;
+
+    // shared with the flusher, guarded by flush_mutex
+    size_t pending_len;
+    bool pending;
+    bool stopped;
+    sync_stats stats_;
+
+    std::mutex flush_mutex;
+    std::condition_variable flush_cv;
+    std::thread flusher;
+
+    void flush_loop() {
+        size_t offset = 0;
+        size_t unsynced = 0;
+        auto last_sync = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> guard(flush_mutex);
+        while (true) {
+            flush_cv.wait(guard, [this]{return pending || stopped;});
+            if (!pending) return;
+
+            char* buf = buffers[1 - fill];
+            size_t len = pending_len;
+            guard.unlock();
+
+            if (pwrite(fd, buf, len, offset) < 0) perror("pwrite");
+            offset += len;
+            unsynced += len;
+
+            auto now = std::chrono::steady_clock::now();
+            bool sync = (policy.kind == sync_policy::bytes && unsynced >= policy.every_bytes)
+                     || (policy.kind == sync_policy::interval && now - last_sync >= policy.every_us);
+            uint64_t sync_us = 0;
+            if (sync) {
+                fdatasync(fd);
+                last_sync = std::chrono::steady_clock::now();
+                sync_us = std::chrono::duration_cast<std::chrono::microseconds>(last_sync - now).count();
+                unsynced = 0;
+            }
+
+            guard.lock();
+            if (sync) {
+                stats_.count++;
+                stats_.total_us += sync_us;
+                stats_.max_us = std::max(stats_.max_us, sync_us);
+            }
+            pending = false;
+            flush_cv.notify_all();
+        }
+    }
+
+    // hands the fill buffer to the flusher once it is done with the other one
+    void hand_over(size_t len) {
+        std::unique_lock<std::mutex> guard(flush_mutex);
+        flush_cv.wait(guard, [this]{return !pending;});
+        fill = 1 - fill;
+        pending_len = len;
+        pending = true;
+        guard.unlock();
+        flush_cv.notify_all();
+    }
+
+    public:
+        // block_size must be a multiple of 4096
+        direct_file_sink(char const* filename, sync_policy policy, size_t block_size = 1*1024*1024) :
+            fd(open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644)),
+            block_size(block_size),
+            policy(policy),
+            fill(0),
+            write_idx(0),
+            file_size(0),
+            pending_len(0),
+            pending(false),
+            stopped(false),
+            stats_{0, 0, 0}
+        {
+            if (fd < 0 && errno == EINVAL) {
+                fprintf(stderr, "%s: O_DIRECT not supported, using buffered I/O\n", filename);
+                fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            }
+            if (fd < 0) perror(filename);
+
+            for (auto& buf : buffers) {
+                void* ptr = nullptr;
+                int err = posix_memalign(&ptr, alignment, block_size);
+                buf = err == 0 ? static_cast<char*>(ptr) : nullptr;
+
+                // like a failed open: the sink drops what it is given
+                if (err != 0 && fd >= 0) {
+                    fprintf(stderr, "%s: %s\n", filename, strerror(err));
+                    close(fd);
+                    fd = -1;
+                }
+            }
+
+            flusher = std::thread([this]{ flush_loop(); });
+        }
+
+        virtual ~direct_file_sink() {
+            // O_DIRECT needs whole blocks, so the tail is padded and cut off afterwards
+            if (write_idx > 0) {
+                size_t padded = (write_idx + alignment - 1) / alignment * alignment;
+                std::memset(buffers[fill] + write_idx, 0, padded - write_idx);
+                hand_over(padded);
+            }
+
+            std::unique_lock<std::mutex> guard(flush_mutex);
+            flush_cv.wait(guard, [this]{return !pending;});
+            stopped = true;
+            guard.unlock();
+            flush_cv.notify_all();
+            flusher.join();
+
+            if (fd >= 0) {
+                if (ftruncate(fd, file_size) != 0) perror("ftruncate");
+                if (policy.kind != sync_policy::never) fdatasync(fd);
+                close(fd);
+            }
+
+            for (auto buf : buffers) free(buf);
+        }
+
+        sync_stats stats() {
+            std::lock_guard<std::mutex> guard(flush_mutex);
+            return stats_;
+        }
+
+        virtual size_t put(char* src, std::streamsize n) override {
+            if (fd < 0) return n;
+
+            size_t total_count = 0;
+            while (total_count < static_cast<size_t>(n)) {
+                size_t count = std::min<size_t>(block_size - write_idx, n - total_count);
+                std::memcpy(buffers[fill] + write_idx, src + total_count, count);
+                write_idx += count;
+                total_count += count;
+                file_size += count;
+
+                if (write_idx == block_size) {
+                    hand_over(block_size);
+                    write_idx = 0;
+                }
+            }
+
+            return n;
+        }
+
+        virtual void stop() override {}
+};
+
+// Sends everything put() over a socket to a socket_peer that drains it on
+// its own thread (see socket.h). Datagram sockets send a put() as
+// datagram_size messages, batch at a time. With zerocopy, put() waits for
+// the kernel to be done with the caller's pages before it returns, since
+// the caller may reuse them straight away.
+class socket_sink : public sink, public socket_endpoint {
+    socket_options opts;
+    int near;
+    int far;
+    std::unique_ptr<socket_peer> peer;
+    zerocopy_tracker zc;
+    message_batch batch;
+    std::atomic<bool> stopped;
+    uint64_t bytes;
+
+    public:
+        socket_sink(socket_options const& opts) :
+            opts(opts),
+            batch(opts),
+            stopped(false),
+            bytes(0)
+        {
+            if (!connect_sockets(opts, near, far)) {
+                perror(("socket_sink " + opts.kind).c_str());
+                return;
+            }
+            peer.reset(new socket_peer(far, opts, false));
+            if (opts.zerocopy) zc.enable(near);
+        }
+
+        virtual ~socket_sink() {
+            peer.reset();
+            if (near >= 0) close(near);
+            if (far >= 0) close(far);
+        }
+
+        virtual size_t put(char* src, std::streamsize n) override {
+            if (!peer) return 0;
+
+            size_t count = 0;
+            if (opts.datagram()) {
+                while (count < static_cast<size_t>(n) && !stopped) {
+                    size_t sent = batch.send(near, src + count, n - count, zc);
+                    if (sent == 0) break;
+                    count += sent;
+                }
+            } else {
+                ssize_t res = send(near, src, n, zc.flags() | MSG_NOSIGNAL);
+                if (res > 0) {
+                    count = res;
+                    zc.on_send(1);
+                }
+            }
+
+            zc.reap(true, stopped);
+            bytes += count;
+            return count;
+        }
+
+        virtual void stop() override {
+            stopped = true;
+            if (peer) peer->stop();
+        }
+
+        virtual std::string socket_stats() const override {
+            std::string res = opts.kind + " sink, sent " + std::to_string(bytes) + " bytes";
+            if (opts.datagram()) res += ", " + batch.str();
+            if (opts.zerocopy) res += ", " + zc.str();
+            if (!peer) return res;
+
+            res += "; " + peer->str();
+            if (opts.datagram() && bytes > 0) res += ", " + std::to_string(100 * peer->count() / bytes) + "% delivered";
+            return res;
+        }
+};
+
 class null_sink : public sink {
     public:
         virtual size_t put(char* src, std::streamsize n) override { return n; }
         virtual void stop() override {}
 };
 
+// A sink that does something with every chunk and hands it on to the
+// sink it wraps.
+class sink_stage : public sink {
+    protected:
+        std::shared_ptr<sink> dst;
+
+        // keeps going until dst has taken all of [src, src + n) or returns 0
+        size_t forward(char* src, std::streamsize n) {
+            std::streamsize write_idx = 0;
+            while (write_idx < n) {
+                size_t count = dst->put(src + write_idx, n - write_idx);
+                if (count == 0) break;
+                write_idx += count;
+            }
+            return write_idx;
+        }
+
+    public:
+        sink_stage(std::shared_ptr<sink> dst) :
+            dst(dst) {}
+
+        virtual void stop() override { dst->stop(); }
+
+        std::shared_ptr<sink> const& next() const { return dst; }
+};
+
+// Runs every chunk through a transform stage, in place, before handing it
+// on to the wrapped sink. A chunk is only transformed once, so put() keeps
+// going until the wrapped sink has taken all of it or returns 0.
+class transform_sink : public sink_stage {
+    ygg::transform stage;
+
+    public:
+        transform_sink(std::shared_ptr<sink> dst, ygg::transform stage) :
+            sink_stage(dst),
+            stage(stage) {}
+
+        virtual size_t put(char* src, std::streamsize n) override {
+            stage.apply(src, n);
+            return forward(src, n);
+        }
+
+        ygg::transform const& transform() const { return stage; }
+};
+
+// Deduplicates the stream before handing it on: cuts it into content
+// defined chunks (see cdc_chunker), fingerprints each one and looks it up
+// in a dedup_index. Only novel chunks are forwarded with their bytes, a
+// repeat goes out as a chunk_record reference alone. Records are gathered
+// in an output buffer and forwarded at the end of every put(), so the
+// stage never holds on to more than the chunk still open; that one is
+// emitted when the stage is destroyed. Each stage has its own index, so
+// with several consumers every one deduplicates the chunks it sees.
+class dedup_sink : public sink_stage {
+    cdc_chunker chunker;
+    dedup_index index;
+    isa level;
+    std::vector<char> pending;
+    std::vector<char> out;
+    dedup_stats totals;
+
+    void emit(char const* data, size_t n) {
+        uint64_t fingerprint = chunk_fingerprint(data, n, level);
+        bool novel = index.insert(fingerprint);
+        chunk_record record{static_cast<uint32_t>(n), novel, fingerprint};
+
+        char const* header = reinterpret_cast<char const*>(&record);
+        out.insert(out.end(), header, header + sizeof(record));
+        if (novel) out.insert(out.end(), data, data + n);
+
+        totals.chunks++;
+        totals.bytes_in += n;
+        if (novel) {
+            totals.novel_chunks++;
+            totals.novel_bytes += n;
+        }
+    }
+
+    void flush() {
+        totals.bytes_out += forward(out.data(), out.size());
+        out.clear();
+    }
+
+    public:
+        dedup_sink(std::shared_ptr<sink> dst, size_t avg_chunk, std::string const& level_name = "auto") :
+            sink_stage(dst),
+            chunker(avg_chunk),
+            level(parse_isa(level_name))
+        {
+            pending.reserve(chunker.max_chunk());
+        }
+
+        virtual ~dedup_sink() {
+            if (!pending.empty()) emit(pending.data(), pending.size());
+            flush();
+        }
+
+        // A chunk that lies within src is fingerprinted in place; only the
+        // start of one that continues into the next put() is copied.
+        virtual size_t put(char* src, std::streamsize n) override {
+            uint64_t start = steady_ns();
+
+            size_t read_idx = 0;
+            while (read_idx < static_cast<size_t>(n)) {
+                bool cut = false;
+                size_t count = chunker.scan(src + read_idx, n - read_idx, cut);
+                if (!cut) {
+                    pending.insert(pending.end(), src + read_idx, src + read_idx + count);
+                } else if (pending.empty()) {
+                    emit(src + read_idx, count);
+                } else {
+                    pending.insert(pending.end(), src + read_idx, src + read_idx + count);
+                    emit(pending.data(), pending.size());
+                    pending.clear();
+                }
+                read_idx += count;
+            }
+
+            totals.busy_ns += steady_ns() - start;
+            flush();
+            return n;
+        }
+
+        cdc_chunker const& chunks() const { return chunker; }
+        dedup_index const& fingerprints() const { return index; }
+        dedup_stats const& stats() const { return totals; }
+};
+
+// Measures the end-to-end latency of the records of a paced_source (see
+// pacing.h): a record arrives once the wrapped sink has taken its last
+// byte, and its latency counts from the time the source meant to send it.
+// The stages it wraps may rewrite src in place (see transform_sink), so the
+// record headers are taken out before forwarding.
+class latency_sink : public sink_stage {
+    record_tracker tracker;
+
+    public:
+        latency_sink(std::shared_ptr<sink> dst, size_t record_size) :
+            sink_stage(dst),
+            tracker(record_size) {}
+
+        virtual size_t put(char* src, std::streamsize n) override {
+            tracker.capture(src, n);
+            size_t count = forward(src, n);
+            tracker.deliver(count, steady_ns());
+            return count;
+        }
+
+        record_tracker const& records() const { return tracker; }
+};
+
 }
 
 #endif
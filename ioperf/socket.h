@@ -0,0 +1,329 @@
+#ifndef SOCKET_H
+#define SOCKET_H
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "rng.h"
+
+namespace ygg {
+
+// What the socket sources and sinks connect over:
+//
+//   unix        AF_UNIX stream (socketpair)
+//   unix-dgram  AF_UNIX datagrams (socketpair)
+//   tcp         TCP over 127.0.0.1
+//   udp         UDP over 127.0.0.1
+//
+// Datagrams are datagram_size bytes and move batch at a time through
+// sendmmsg/recvmmsg; stream sockets move a whole put() or get() in one
+// call, so batch only applies to datagrams.
+struct socket_options {
+    std::string kind = "unix";
+    size_t buffer_size = 0; // SO_SNDBUF and SO_RCVBUF on both ends, 0 keeps the default
+    size_t batch = 16;
+    size_t datagram_size = 16*1024;
+    bool zerocopy = false;
+
+    bool datagram() const { return kind == "unix-dgram" || kind == "udp"; }
+};
+
+// Blocking calls on either end give up after this long, so that stop()
+// never waits for a peer that went quiet.
+constexpr int socket_timeout_ms = 100;
+
+// Connects near (the source's or sink's end) to far (the peer's end).
+// Returns false with errno set if any step fails.
+inline bool connect_sockets(socket_options const& opts, int& near, int& far) {
+    near = far = -1;
+    int type = opts.datagram() ? SOCK_DGRAM : SOCK_STREAM;
+
+    if (opts.kind == "unix" || opts.kind == "unix-dgram") {
+        int fds[2];
+        if (socketpair(AF_UNIX, type | SOCK_CLOEXEC, 0, fds) != 0) return false;
+        near = fds[0];
+        far = fds[1];
+    } else {
+        auto bound = [&]() {
+            int fd = socket(AF_INET, type | SOCK_CLOEXEC, 0);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (fd >= 0 && bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                close(fd);
+                fd = -1;
+            }
+            return fd;
+        };
+        auto address = [](int fd) {
+            sockaddr_in addr{};
+            socklen_t len = sizeof(addr);
+            getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+            return addr;
+        };
+
+        // the listener is the caller's to close only once it is far
+        int listener = bound();
+        auto fail = [&]() {
+            int err = errno;
+            if (listener >= 0) close(listener);
+            errno = err;
+            return false;
+        };
+
+        near = bound();
+        if (listener < 0 || near < 0) return fail();
+
+        sockaddr_in listener_addr = address(listener);
+        if (opts.datagram()) {
+            sockaddr_in near_addr = address(near);
+            far = listener;
+            listener = -1;
+            if (connect(near, reinterpret_cast<sockaddr*>(&listener_addr), sizeof(listener_addr)) != 0) return false;
+            if (connect(far, reinterpret_cast<sockaddr*>(&near_addr), sizeof(near_addr)) != 0) return false;
+        } else {
+            // the connection completes in the backlog, before accept()
+            if (listen(listener, 1) != 0) return fail();
+            if (connect(near, reinterpret_cast<sockaddr*>(&listener_addr), sizeof(listener_addr)) != 0) return fail();
+            far = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            close(listener);
+            if (far < 0) return false;
+        }
+    }
+
+    timeval tv{0, socket_timeout_ms * 1000};
+    for (int fd : {near, far}) {
+        if (opts.buffer_size > 0) {
+            int size = static_cast<int>(opts.buffer_size);
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    return true;
+}
+
+// MSG_ZEROCOPY bookkeeping for one socket. The kernel pins the pages of a
+// zerocopy send and reports on the socket's error queue when it's done
+// with them; until then the sender must not touch the buffer. Loopback
+// and AF_UNIX deliver by copying anyway, which the completion reports too.
+class zerocopy_tracker {
+    int fd;
+    bool enabled;
+    uint64_t sent;
+    uint64_t completed;
+    uint64_t copied;
+
+    public:
+        zerocopy_tracker() :
+            fd(-1),
+            enabled(false),
+            sent(0),
+            completed(0),
+            copied(0) {}
+
+        // stays off where the socket doesn't support it (AF_UNIX)
+        void enable(int socket_fd) {
+            int one = 1;
+            fd = socket_fd;
+            enabled = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+        }
+
+        bool active() const { return enabled; }
+        int flags() const { return enabled ? MSG_ZEROCOPY : 0; }
+
+        // count is the number of send calls (messages, for sendmmsg)
+        void on_send(size_t count) { sent += count; }
+
+        // Drains the error queue; with wait set, until every send so far has
+        // completed or stopped becomes true.
+        void reap(bool wait, std::atomic<bool> const& stopped) {
+            while (enabled && completed < sent) {
+                char control[128];
+                msghdr msg{};
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+
+                if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                    if (!wait || stopped) return;
+                    pollfd p{fd, 0, 0}; // POLLERR is always reported
+                    poll(&p, 1, socket_timeout_ms);
+                    continue;
+                }
+
+                for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                    auto err = reinterpret_cast<sock_extended_err const*>(CMSG_DATA(cm));
+                    if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+                    uint64_t range = static_cast<uint32_t>(err->ee_data - err->ee_info) + 1ull;
+                    completed += range;
+                    if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) copied += range;
+                }
+            }
+        }
+
+        std::string str() const {
+            if (!enabled) return "zerocopy unsupported";
+            return "zerocopy " + std::to_string(completed) + "/" + std::to_string(sent) + " completed, "
+                + std::to_string(copied) + " copied by the kernel";
+        }
+};
+
+// sendmmsg/recvmmsg over consecutive datagram_size slices of a buffer.
+class message_batch {
+    std::vector<mmsghdr> msgs;
+    std::vector<iovec> iovs;
+    size_t datagram_size;
+
+    public:
+        uint64_t calls = 0;
+        uint64_t messages = 0;
+
+        message_batch(socket_options const& opts) :
+            msgs(std::max<size_t>(opts.batch, 1)),
+            iovs(std::max<size_t>(opts.batch, 1)),
+            datagram_size(opts.datagram_size) {}
+
+        // Sets up as many slices of [buf, buf + n) as fit in one batch and
+        // returns how many there are.
+        size_t prepare(char* buf, size_t n) {
+            size_t count = std::min(msgs.size(), (n + datagram_size - 1) / datagram_size);
+            for (size_t i = 0; i < count; i++) {
+                iovs[i].iov_base = buf + i * datagram_size;
+                iovs[i].iov_len = std::min(datagram_size, n - i * datagram_size);
+                std::memset(&msgs[i], 0, sizeof(mmsghdr));
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            return count;
+        }
+
+        // bytes sent, 0 on timeout or error
+        size_t send(int fd, char* buf, size_t n, zerocopy_tracker& zc) {
+            size_t count = prepare(buf, n);
+            int res = sendmmsg(fd, msgs.data(), count, zc.flags() | MSG_NOSIGNAL);
+            if (res <= 0) return 0;
+
+            calls++;
+            messages += res;
+            zc.on_send(res);
+            size_t bytes = 0;
+            for (int i = 0; i < res; i++) bytes += msgs[i].msg_len;
+            return bytes;
+        }
+
+        // Bytes received into buf, datagrams packed back to back. Takes
+        // whatever is queued once the first datagram arrived.
+        size_t receive(int fd, char* buf, size_t n) {
+            size_t count = prepare(buf, n);
+            int res = recvmmsg(fd, msgs.data(), count, MSG_WAITFORONE, nullptr);
+            if (res <= 0) return 0;
+
+            calls++;
+            messages += res;
+            size_t bytes = 0;
+            for (int i = 0; i < res; i++) {
+                if (buf + bytes != iovs[i].iov_base) std::memmove(buf + bytes, iovs[i].iov_base, msgs[i].msg_len);
+                bytes += msgs[i].msg_len;
+            }
+            return bytes;
+        }
+
+        std::string str() const {
+            if (calls == 0) return "no batches";
+            char res[64];
+            snprintf(res, sizeof(res), "%.1f datagrams per call", static_cast<double>(messages) / calls);
+            return res;
+        }
+};
+
+// The other end of a socket source or sink, on its own thread: it either
+// floods the socket with pseudo-random data (for a source) or drains and
+// discards everything (for a sink), counting the bytes either way.
+class socket_peer {
+    int fd;
+    socket_options opts;
+    bool sending;
+    std::vector<char> buf;
+    std::atomic<bool> stopped;
+    std::atomic<uint64_t> bytes;
+    zerocopy_tracker zc;
+    message_batch batch;
+    std::thread thread;
+
+    void loop() {
+        while (!stopped) {
+            size_t count = 0;
+            if (opts.datagram()) {
+                count = sending ? batch.send(fd, buf.data(), buf.size(), zc) : batch.receive(fd, buf.data(), buf.size());
+            } else {
+                ssize_t res = sending ? ::send(fd, buf.data(), buf.size(), zc.flags() | MSG_NOSIGNAL) : recv(fd, buf.data(), buf.size(), 0);
+                if (res > 0 && sending) zc.on_send(1);
+                if (res == 0 && !sending) break; // the other end is gone
+                count = std::max<ssize_t>(res, 0);
+            }
+            bytes.fetch_add(count, std::memory_order_relaxed);
+
+            // the buffer never changes, so completions need not be waited for
+            zc.reap(false, stopped);
+        }
+    }
+
+    public:
+        socket_peer(int fd, socket_options const& opts, bool sending) :
+            fd(fd),
+            opts(opts),
+            sending(sending),
+            buf(opts.datagram() ? std::max<size_t>(opts.batch, 1) * opts.datagram_size : 1024*1024),
+            stopped(false),
+            bytes(0),
+            batch(opts)
+        {
+            if (sending && opts.zerocopy) zc.enable(fd);
+            if (sending) xoshiro_lanes(0x5eed).fill(buf.data(), buf.size());
+            thread = std::thread([this] { loop(); });
+        }
+
+        ~socket_peer() { stop(); }
+
+        // returns once the peer thread is gone, so its counts are final
+        void stop() {
+            stopped = true;
+            if (thread.joinable()) thread.join();
+        }
+
+        uint64_t count() const { return bytes.load(std::memory_order_relaxed); }
+
+        std::string str() const {
+            std::string res = std::string("peer ") + (sending ? "sent " : "received ") + std::to_string(count()) + " bytes";
+            if (opts.datagram()) res += ", " + batch.str();
+            if (sending && opts.zerocopy) res += ", " + zc.str();
+            return res;
+        }
+};
+
+// Implemented by the socket sources and sinks, for reporting after a run.
+class socket_endpoint {
+    public:
+        virtual std::string socket_stats() const = 0;
+};
+
+}
+
+#endif
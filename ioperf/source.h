@@ -5,7 +5,27 @@
 #include <fstream>
 #include <random>
 #include <limits>
+#include <array>
 #include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "async_io.h"
+#include "socket.h"
+#include "rng.h"
+#include "pacing.h"
+#include "container.h"
 
 namespace ygg {
 
@@ -13,6 +33,18 @@ class source {
     public:
         virtual size_t get(char* dst, std::streamsize n) = 0;
         virtual void stop() = 0;
+
+        // Fills count segments in order, stopping at the first short get().
+        // Sources that can scatter in one call override this.
+        virtual size_t getv(span<char> const* segs, size_t count) {
+            size_t total = 0;
+            for (size_t i = 0; i < count; i++) {
+                size_t n = get(segs[i].data, segs[i].size);
+                total += n;
+                if (n < segs[i].size) break;
+            }
+            return total;
+        }
 };
 
 class file_source : public source {
@@ -38,27 +70,331 @@ class file_source : public source {
         virtual void stop() override {}
 };
 
-class random_source : public source {
-    std::random_device seed;
-    //std::independent_bits_engine<std::mt19937_64, 64, uint64_t> gen;
-    //std::mt19937_64 gen;
-    std::subtract_with_carry_engine<uint_fast64_t, 64, 5, 16> gen;
+// file_source on a raw descriptor: read(2) without a stream buffer, and the
+// descriptor's file offset is shared with kernel-side copies (see
+// kernel_copy_worker). Wraps around at EOF.
+class fd_file_source : public source, public fd_endpoint {
+    int file_fd;
 
     public:
-        random_source() :
-            gen(seed()) {}
+        fd_file_source(char const* filename) :
+            file_fd(open(filename, O_RDONLY))
+        {
+            if (file_fd < 0) perror(filename);
+        }
+
+        virtual ~fd_file_source() {
+            if (file_fd >= 0) close(file_fd);
+        }
+
+        virtual int fd() const override { return file_fd; }
 
         virtual size_t get(char* dst, std::streamsize n) override {
-            uint64_t* d = reinterpret_cast<uint64_t*>(dst);
-            for (size_t i = 0; i < n / 8; i++) {
-                d[i] = gen();
+            ssize_t count = read(file_fd, dst, n);
+            if (count == 0) {
+                lseek(file_fd, 0, SEEK_SET);
+                count = read(file_fd, dst, n);
+            }
+
+            return count > 0 ? count : 0;
+        }
+
+        virtual size_t getv(span<char> const* segs, size_t count) override {
+            iovec iov[max_segments];
+            count = std::min(count, max_segments);
+            for (size_t i = 0; i < count; i++) iov[i] = {segs[i].data, segs[i].size};
+
+            ssize_t res = readv(file_fd, iov, count);
+            if (res == 0) {
+                lseek(file_fd, 0, SEEK_SET);
+                res = readv(file_fd, iov, count);
+            }
+
+            return res > 0 ? res : 0;
+        }
+
+        virtual void stop() override {}
+};
+
+// Maps the whole input once and reads it sequentially, wrapping around at
+// EOF like file_source does.
+class mmap_file_source : public source {
+    char* data;
+    size_t size;
+    size_t read_idx;
+
+    public:
+        mmap_file_source(char const* filename) :
+            data(nullptr),
+            size(0),
+            read_idx(0)
+        {
+            int fd = open(filename, O_RDONLY);
+            if (fd < 0) {
+                perror(filename);
+                return;
             }
+
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (addr != MAP_FAILED) {
+                    data = static_cast<char*>(addr);
+                    size = st.st_size;
+                    madvise(data, size, MADV_SEQUENTIAL);
+                } else {
+                    perror(filename);
+                }
+            }
+
+            close(fd);
+        }
+
+        virtual ~mmap_file_source() {
+            if (data) munmap(data, size);
+        }
+
+        // Hands out up to n bytes of the mapping without copying them. The
+        // span never crosses EOF; the next call starts over at the beginning.
+        span<char> next(size_t n) {
+            span<char> region{data + read_idx, std::min(size - read_idx, n)};
+            read_idx += region.size;
+            if (read_idx == size) read_idx = 0;
+            return region;
+        }
+
+        virtual size_t get(char* dst, std::streamsize n) override {
+            span<char> region = next(n);
+            std::memcpy(dst, region.data, region.size);
+            return region.size;
+        }
+
+        virtual void stop() override {}
+};
+
+// Keeps queue_depth reads in flight through io_uring (or a pread thread
+// pool where io_uring is unavailable), wrapping around at EOF.
+class uring_file_source : public source {
+    async_reader reader;
+
+    public:
+        uring_file_source(char const* filename, size_t queue_depth = 8, size_t block_size = 256*1024) :
+            reader(filename, queue_depth, block_size) {}
+
+        char const* backend() const { return reader.backend(); }
+
+        virtual size_t get(char* dst, std::streamsize n) override {
+            return reader.read(dst, n);
+        }
+
+        virtual void stop() override {}
+};
+
+// Reads an ioperf container (see container.h). Of parts sources on the
+// same file, source part takes the part-th share of the block index and
+// reads those blocks with pread, so parts sources read disjoint ranges in
+// parallel without sharing a file offset. Every block is checked against
+// its header and index entry; a damaged block is counted and skipped. A
+// get() of at least a whole block reads it straight into dst, smaller ones
+// are served from a block buffer. Wraps around to the first block of its
+// range at the end.
+class block_file_source : public source {
+    container_reader reader;
+    size_t part;
+    size_t parts;
+    size_t first;
+    size_t last;
+    size_t next;
+    std::vector<char> buf;
+    size_t buf_idx;
+    size_t buf_size;
+    uint64_t blocks_read;
+    uint64_t blocks_damaged;
+
+    // the next block of the range into dst, 0 if damaged
+    size_t read_next(char* dst) {
+        ssize_t count = reader.read(next, dst);
+        next = next + 1 == last ? first : next + 1;
+        if (count < 0) {
+            blocks_damaged++;
+            return 0;
+        }
+        blocks_read++;
+        return count;
+    }
+
+    public:
+        block_file_source(char const* filename, size_t part = 0, size_t parts = 1) :
+            reader(filename),
+            part(part),
+            parts(std::max<size_t>(parts, 1)),
+            first(reader.blocks() * part / this->parts),
+            last(reader.blocks() * (part + 1) / this->parts),
+            next(first),
+            buf(first < last ? reader.max_length() : 0),
+            buf_idx(0),
+            buf_size(0),
+            blocks_read(0),
+            blocks_damaged(0) {}
+
+        virtual size_t get(char* dst, std::streamsize n) override {
+            if (buf_idx == buf_size) {
+                if (first == last) return 0;
+                if (static_cast<size_t>(n) >= reader.length(next)) return read_next(dst);
+
+                buf_idx = 0;
+                buf_size = read_next(buf.data());
+                if (buf_size == 0) return 0;
+            }
+
+            size_t count = std::min<size_t>(n, buf_size - buf_idx);
+            std::memcpy(dst, buf.data() + buf_idx, count);
+            buf_idx += count;
+            return count;
+        }
+
+        virtual void stop() override {}
+
+        std::string str() const {
+            std::string res = "block source " + std::to_string(part) + "/" + std::to_string(parts) + ": blocks [" +
+                std::to_string(first) + ", " + std::to_string(last) + ") of " + std::to_string(reader.blocks());
+            if (reader.recovered()) res += " (no index, recovered by scanning)";
+            return res + ", " + std::to_string(blocks_read) + " read, " + std::to_string(blocks_damaged) + " damaged";
+        }
+};
+
+// Receives from a socket_peer that floods the socket with pseudo-random
+// data on its own thread (see socket.h). Datagram sockets receive up to
+// batch datagrams per get() and pack them back to back, so n should be at
+// least datagram_size; anything shorter truncates the datagram.
+class socket_source : public source, public socket_endpoint {
+    socket_options opts;
+    int near;
+    int far;
+    std::unique_ptr<socket_peer> peer;
+    message_batch batch;
+    uint64_t bytes;
+
+    public:
+        socket_source(socket_options const& opts) :
+            opts(opts),
+            batch(opts),
+            bytes(0)
+        {
+            if (!connect_sockets(opts, near, far)) {
+                perror(("socket_source " + opts.kind).c_str());
+                return;
+            }
+            peer.reset(new socket_peer(far, opts, true));
+        }
+
+        virtual ~socket_source() {
+            peer.reset();
+            if (near >= 0) close(near);
+            if (far >= 0) close(far);
+        }
+
+        virtual size_t get(char* dst, std::streamsize n) override {
+            if (!peer) return 0;
+
+            size_t count = 0;
+            if (opts.datagram() && static_cast<size_t>(n) >= opts.datagram_size) {
+                count = batch.receive(near, dst, n - n % opts.datagram_size);
+            } else {
+                count = std::max<ssize_t>(recv(near, dst, n, 0), 0);
+            }
+            bytes += count;
+            return count;
+        }
+
+        virtual void stop() override {
+            if (peer) peer->stop();
+        }
+
+        virtual std::string socket_stats() const override {
+            std::string res = opts.kind + " source, received " + std::to_string(bytes) + " bytes";
+            if (opts.datagram()) res += ", " + batch.str();
+            if (!peer) return res;
+
+            res += "; " + peer->str();
+            if (opts.datagram() && peer->count() > 0) res += ", " + std::to_string(100 * bytes / peer->count()) + "% delivered";
+            return res;
+        }
+};
+
+// Fresh pseudo-random bytes on every get(), from eight xoshiro256** lanes
+// (AVX2 where available). The same non-zero seed always gives the same
+// stream; seed 0 picks one from std::random_device.
+class random_source : public source {
+    xoshiro_lanes gen;
+
+    static uint64_t pick_seed(uint64_t seed) {
+        if (seed != 0) return seed;
+        std::random_device rd;
+        return (static_cast<uint64_t>(rd()) << 32) | rd();
+    }
+
+    public:
+        random_source(uint64_t seed = 0) :
+            gen(pick_seed(seed)) {}
+
+        // the xoshiro kernel that fills dst, avx2 or scalar
+        isa kernel() const { return gen.kernel(); }
+
+        virtual size_t get(char* dst, std::streamsize n) override {
+            gen.fill(dst, n);
             return n;
         }
 
         virtual void stop() override {}
 };
 
+// Open-loop load (see pacing.h): emits record_size records at rate bytes
+// a second on an arrival_schedule, each stamped with its sequence number
+// and intended send time. A get() returns at most the rest of the current
+// record and only waits for the schedule at the start of one; when behind
+// schedule it sends straight away. The payload is whatever dst held.
+class paced_source : public source {
+    arrival_schedule schedule;
+    size_t record_size;
+    size_t offset;
+    record_header header;
+    std::atomic<bool> stopped;
+
+    public:
+        paced_source(double rate, size_t record_size, std::string const& arrival, uint64_t seed = 1) :
+            schedule(rate / std::max(record_size, sizeof(record_header)), arrival, seed),
+            record_size(std::max(record_size, sizeof(record_header))),
+            offset(0),
+            header{0, 0},
+            stopped(false) {}
+
+        virtual size_t get(char* dst, std::streamsize n) override {
+            if (offset == 0) {
+                header.intended_ns = schedule.next();
+                wait_until_ns(header.intended_ns, stopped);
+                if (stopped) return 0;
+            }
+
+            size_t count = std::min<size_t>(n, record_size - offset);
+            if (offset < sizeof(record_header)) {
+                size_t part = std::min(count, sizeof(record_header) - offset);
+                std::memcpy(dst, reinterpret_cast<char const*>(&header) + offset, part);
+            }
+
+            offset += count;
+            if (offset == record_size) {
+                offset = 0;
+                header.sequence++;
+            }
+            return count;
+        }
+
+        virtual void stop() override { stopped = true; }
+};
+
+// Replays one random buffer, which costs nothing to produce but is
+// trivially compressible and dedupable across chunks; see random_source.
 template<size_t Capacity>
 class random_buf_source : public source {
     std::random_device seed;
@@ -0,0 +1,248 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "arena.h"
+
+namespace ygg {
+
+// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+inline std::vector<int> parse_cpu_list(std::string const& str) {
+    std::vector<int> res;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) continue;
+        size_t dash = item.find('-');
+        int first = std::stoi(item.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+        for (int cpu = first; cpu <= last; cpu++) res.push_back(cpu);
+    }
+    return res;
+}
+
+struct cpu_info {
+    int cpu;
+    int core;    // physical core, unique within a package
+    int package; // socket
+    int node;    // NUMA node
+};
+
+// Online CPUs as described by sysfs. Anything sysfs doesn't tell us
+// defaults to 0, so a machine without the topology files looks like one
+// socket of single-threaded cores on node 0.
+inline std::vector<cpu_info> detect_topology() {
+    auto read_file = [](std::string const& path) {
+        std::ifstream ifs(path);
+        std::string res;
+        std::getline(ifs, res);
+        return res;
+    };
+    auto read_int = [&](std::string const& path) {
+        std::string str = read_file(path);
+        return str.empty() ? 0 : std::stoi(str);
+    };
+
+    std::string online = read_file("/sys/devices/system/cpu/online");
+    std::vector<int> cpus = online.empty() ? std::vector<int>{0} : parse_cpu_list(online);
+
+    std::vector<cpu_info> res;
+    for (int cpu : cpus) {
+        std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        res.push_back({cpu, read_int(dir + "core_id"), read_int(dir + "physical_package_id"), 0});
+    }
+
+    std::vector<int> nodes = parse_cpu_list(read_file("/sys/devices/system/node/online"));
+    for (int node : nodes) {
+        std::string list = read_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        for (int cpu : parse_cpu_list(list)) {
+            for (auto& info : res) if (info.cpu == cpu) info.node = node;
+        }
+    }
+    return res;
+}
+
+// Where each worker of a run goes: worker w is pinned to cpus[w % size]
+// (nowhere if cpus is empty), and memory is bound to mem_node if it is not
+// -1. home_node is the node all pinned workers share, if they do; without
+// a bound node, buffers are preferably placed there.
+struct placement {
+    std::vector<std::vector<int>> cpus;
+    int mem_node = -1;
+    int home_node = -1;
+    std::string error; // set if the requested layout doesn't fit this machine
+
+    static void set_policy(int mode, int node) {
+        size_t bits = sizeof(unsigned long) * 8;
+        std::vector<unsigned long> mask(node / bits + 1, 0);
+        mask[node / bits] |= 1ul << (node % bits);
+
+        // the kernel takes one bit less than maxnode says
+        if (syscall(SYS_set_mempolicy, mode, mask.data(), mask.size() * bits + 1) != 0) perror("set_mempolicy");
+    }
+
+    bool pinned() const { return !cpus.empty(); }
+
+    // pins the calling thread as worker w and applies the memory policy
+    void apply(size_t w) const {
+        if (pinned()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : cpus[w % cpus.size()]) CPU_SET(cpu, &set);
+            if (sched_setaffinity(0, sizeof(set), &set) != 0) perror("sched_setaffinity");
+        }
+        bind_memory();
+    }
+
+    // MPOL_BIND to mem_node for the calling thread, if a node was chosen
+    void bind_memory() const {
+        if (mem_node >= 0) set_policy(MPOL_BIND, mem_node);
+    }
+
+    // MPOL_PREFERRED to home_node for the calling thread, if there is one
+    void prefer_memory() const {
+        if (home_node >= 0) set_policy(MPOL_PREFERRED, home_node);
+    }
+
+    static void unbind_memory() {
+        syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0);
+    }
+
+    std::string str() const {
+        std::string res;
+        for (size_t w = 0; w < cpus.size(); w++) {
+            res += (w ? " " : "") + std::string("w") + std::to_string(w + 1) + ":";
+            for (size_t i = 0; i < cpus[w].size(); i++) res += (i ? "," : "") + std::to_string(cpus[w][i]);
+        }
+        if (mem_node >= 0) res += (res.empty() ? "" : " ") + std::string("mem:node") + std::to_string(mem_node);
+        return res;
+    }
+};
+
+// Applies placement's memory policy to the calling thread for as long as
+// it lives, e.g. while a pipeline is being built, and tells the buffer
+// arena which node its blocks are for. The arena prefaults on this
+// thread, so without a bound node the buffers of workers pinned to one
+// node are steered to that node rather than to wherever main runs.
+class memory_binding {
+    bool bound;
+    bool preferred;
+
+    public:
+        memory_binding(placement const& where) :
+            bound(where.mem_node >= 0),
+            preferred(!bound && where.home_node >= 0)
+        {
+            if (bound) where.bind_memory();
+            if (preferred) where.prefer_memory();
+            buffer_arena::instance().set_node(bound ? where.mem_node : where.home_node);
+        }
+
+        ~memory_binding() {
+            if (bound || preferred) placement::unbind_memory();
+            buffer_arena::instance().set_node(-1);
+        }
+};
+
+// Lays out producers + consumers workers, producer i paired with consumer
+// i, according to layout:
+//
+//   none          no pinning
+//   auto          one physical core each, filling the first socket first;
+//                 no pinning if there are more workers than cores
+//   same-core     all on the SMT siblings of one core (or on one CPU)
+//   same-socket   one core each, all in one socket
+//   cross-socket  producers in the first socket, consumers in the second
+//
+// cpus, if not empty, overrides layout with an explicit ':' separated
+// list of CPU lists, one per worker (e.g. "0:1" or "0-3:4-7").
+inline placement make_placement(std::string const& layout, std::string const& cpus, int mem_node,
+        size_t producers, size_t consumers) {
+    placement res;
+    res.mem_node = mem_node;
+    size_t workers = producers + consumers;
+
+    if (!cpus.empty()) {
+        std::stringstream ss(cpus);
+        std::string item;
+        while (std::getline(ss, item, ':')) res.cpus.push_back(parse_cpu_list(item));
+        return res;
+    }
+    if (layout == "none" || layout.empty()) return res;
+
+    std::vector<cpu_info> topo = detect_topology();
+    std::vector<int> packages;
+    for (auto const& info : topo) {
+        if (std::find(packages.begin(), packages.end(), info.package) == packages.end()) packages.push_back(info.package);
+    }
+
+    // first CPU of every physical core in package, or of every package if -1
+    auto cores = [&](int package) {
+        std::vector<cpu_info> res;
+        for (auto const& info : topo) {
+            if (package >= 0 && info.package != package) continue;
+            bool seen = std::any_of(res.begin(), res.end(), [&](cpu_info const& other) {
+                return other.package == info.package && other.core == info.core;
+            });
+            if (!seen) res.push_back(info);
+        }
+        return res;
+    };
+
+    if (layout == "same-core") {
+        std::vector<int> siblings;
+        for (auto const& info : topo) {
+            if (info.package == topo[0].package && info.core == topo[0].core) siblings.push_back(info.cpu);
+        }
+        for (size_t w = 0; w < workers; w++) res.cpus.push_back({siblings[w % siblings.size()]});
+    } else if (layout == "same-socket" || layout == "auto") {
+        std::vector<cpu_info> pool = cores(packages[0]);
+        if (layout == "auto" && pool.size() < workers) pool = cores(-1);
+        if (layout == "auto" && pool.size() < workers) return res;
+        for (size_t w = 0; w < workers; w++) res.cpus.push_back({pool[w % pool.size()].cpu});
+    } else if (layout == "cross-socket") {
+        if (packages.size() < 2) {
+            res.error = "needs two sockets, found " + std::to_string(packages.size());
+            return res;
+        }
+        std::vector<cpu_info> first = cores(packages[0]);
+        std::vector<cpu_info> second = cores(packages[1]);
+        for (size_t w = 0; w < producers; w++) res.cpus.push_back({first[w % first.size()].cpu});
+        for (size_t w = 0; w < consumers; w++) res.cpus.push_back({second[w % second.size()].cpu});
+    } else {
+        res.error = "unknown layout";
+        return res;
+    }
+
+    // the node of every pinned CPU, or -1 if they span more than one
+    int home = -2;
+    for (auto const& list : res.cpus) {
+        for (int cpu : list) {
+            for (auto const& info : topo) {
+                if (info.cpu == cpu) home = home == -2 || home == info.node ? info.node : -1;
+            }
+        }
+    }
+    res.home_node = std::max(home, -1);
+    return res;
+}
+
+inline placement make_placement(pipeline_config const& config) {
+    return make_placement(config.placement, config.cpus, config.mem_node, config.producers, config.consumers);
+}
+
+}
+
+#endif
@@ -0,0 +1,336 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+#include <immintrin.h>
+
+#include "util.h"
+
+namespace ygg {
+
+// Kernels. Every level of a kernel produces the same bytes and the same
+// digest, so they can be compared against each other on the same data.
+
+// CRC32C (Castagnoli), reflected, without the final inversion.
+inline uint32_t crc32c_scalar(uint32_t crc, char const* data, size_t n) {
+    static uint32_t const* table = [] {
+        static uint32_t t[256];
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82f63b78 & (0 - (c & 1)));
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    for (size_t i = 0; i < n; i++) crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_sse42(uint32_t crc, char const* data, size_t n) {
+    uint64_t c = crc;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    for (; i < n; i++) c = _mm_crc32_u8(static_cast<uint32_t>(c), static_cast<uint8_t>(data[i]));
+    return static_cast<uint32_t>(c);
+}
+
+// xxHash-style 64-bit hash: four 64-bit lanes per 32 byte stripe, each
+// accumulating the input word plus the 32x32->64 product of its halves
+// after keying (as in XXH3, which keeps it within what AVX2 can multiply).
+// The key moves on by prime5 with every stripe, like XXH3's sliding
+// secret, so the same stripes in another order give another digest.
+struct hash64_state {
+    static constexpr uint64_t prime1 = 0x9e3779b185ebca87ull;
+    static constexpr uint64_t prime2 = 0xc2b2ae3d27d4eb4full;
+    static constexpr uint64_t prime3 = 0x165667b19e3779f9ull;
+    static constexpr uint64_t prime4 = 0x85ebca77c2b2ae63ull;
+    static constexpr uint64_t prime5 = 0x27d4eb2f165667c5ull;
+
+    uint64_t acc[4] = {prime1, prime2, prime3, prime4};
+    uint64_t length = 0;
+    uint64_t stripes = 0;
+
+    static uint64_t key(size_t lane) {
+        static uint64_t const keys[4] = {0xbe4ba423396cfeb8ull, 0x1cad21f72c81017cull, 0xdb979083e96dd4deull, 0x1f67b3b7a4a44072ull};
+        return keys[lane];
+    }
+
+    void stripe_scalar(char const* data) {
+        uint64_t offset = stripes++ * prime5;
+        for (size_t lane = 0; lane < 4; lane++) {
+            uint64_t d;
+            std::memcpy(&d, data + lane * 8, 8);
+            uint64_t k = d ^ (key(lane) + offset);
+            acc[lane] += d + (k & 0xffffffff) * (k >> 32);
+        }
+    }
+
+    // zero padded, so a chunk's tail is hashed the same at every level
+    void tail(char const* data, size_t n) {
+        if (n == 0) return;
+        char stripe[32] = {};
+        std::memcpy(stripe, data, n);
+        stripe_scalar(stripe);
+    }
+
+    static uint64_t avalanche(uint64_t h) {
+        h ^= h >> 33;
+        h *= prime2;
+        h ^= h >> 29;
+        h *= prime3;
+        return h ^ (h >> 32);
+    }
+
+    uint64_t digest() const {
+        uint64_t h = length * prime5;
+        for (size_t lane = 0; lane < 4; lane++) {
+            h ^= avalanche(acc[lane] * prime2);
+            h = ((h << 27) | (h >> 37)) * prime1 + prime4;
+        }
+        return avalanche(h);
+    }
+};
+
+inline void hash64_scalar(hash64_state& s, char const* data, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) s.stripe_scalar(data + i);
+    s.tail(data + i, n - i);
+    s.length += n;
+}
+
+__attribute__((target("sse4.2")))
+inline void hash64_sse42(hash64_state& s, char const* data, size_t n) {
+    __m128i acc0 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(s.acc));
+    __m128i acc1 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(s.acc + 2));
+    __m128i offset = _mm_set1_epi64x(s.stripes * s.prime5);
+    __m128i step = _mm_set1_epi64x(s.prime5);
+    __m128i key0 = _mm_add_epi64(_mm_set_epi64x(s.key(1), s.key(0)), offset);
+    __m128i key1 = _mm_add_epi64(_mm_set_epi64x(s.key(3), s.key(2)), offset);
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m128i d0 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + i));
+        __m128i d1 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + i + 16));
+        __m128i k0 = _mm_xor_si128(d0, key0);
+        __m128i k1 = _mm_xor_si128(d1, key1);
+        key0 = _mm_add_epi64(key0, step);
+        key1 = _mm_add_epi64(key1, step);
+        acc0 = _mm_add_epi64(acc0, _mm_add_epi64(d0, _mm_mul_epu32(k0, _mm_srli_epi64(k0, 32))));
+        acc1 = _mm_add_epi64(acc1, _mm_add_epi64(d1, _mm_mul_epu32(k1, _mm_srli_epi64(k1, 32))));
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(s.acc), acc0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(s.acc + 2), acc1);
+    s.stripes += i / 32;
+    s.tail(data + i, n - i);
+    s.length += n;
+}
+
+__attribute__((target("avx2")))
+inline void hash64_avx2(hash64_state& s, char const* data, size_t n) {
+    __m256i acc = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(s.acc));
+    __m256i step = _mm256_set1_epi64x(s.prime5);
+    __m256i key = _mm256_add_epi64(_mm256_set_epi64x(s.key(3), s.key(2), s.key(1), s.key(0)), _mm256_set1_epi64x(s.stripes * s.prime5));
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(data + i));
+        __m256i k = _mm256_xor_si256(d, key);
+        key = _mm256_add_epi64(key, step);
+        acc = _mm256_add_epi64(acc, _mm256_add_epi64(d, _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32))));
+    }
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(s.acc), acc);
+    s.stripes += i / 32;
+    s.tail(data + i, n - i);
+    s.length += n;
+}
+
+// XOR with a repeating 8 byte key; key's lowest byte goes with data[0].
+inline void xor_scalar(char* data, size_t n, uint64_t key) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        word ^= key;
+        std::memcpy(data + i, &word, 8);
+    }
+    for (; i < n; i++) data[i] ^= static_cast<char>(key >> (8 * (i % 8)));
+}
+
+__attribute__((target("sse4.2")))
+inline void xor_sse42(char* data, size_t n, uint64_t key) {
+    __m128i k = _mm_set1_epi64x(key);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i* p = reinterpret_cast<__m128i*>(data + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), k));
+    }
+    xor_scalar(data + i, n - i, key);
+}
+
+__attribute__((target("avx2")))
+inline void xor_avx2(char* data, size_t n, uint64_t key) {
+    __m256i k = _mm256_set1_epi64x(key);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i* p = reinterpret_cast<__m256i*>(data + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), k));
+    }
+    xor_scalar(data + i, n - i, key);
+}
+
+// Reverses the bytes of every whole word of word_size (2, 4 or 8) bytes.
+inline void bswap_scalar(char* data, size_t n, size_t word_size) {
+    n -= n % word_size;
+    for (size_t i = 0; i < n; i += word_size) std::reverse(data + i, data + i + word_size);
+}
+
+inline __m128i bswap_shuffle(size_t word_size) {
+    char idx[16];
+    for (size_t i = 0; i < 16; i++) idx[i] = static_cast<char>(i - i % word_size + (word_size - 1 - i % word_size));
+    __m128i res;
+    std::memcpy(&res, idx, 16);
+    return res;
+}
+
+__attribute__((target("sse4.2")))
+inline void bswap_sse42(char* data, size_t n, size_t word_size) {
+    __m128i shuffle = bswap_shuffle(word_size);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i* p = reinterpret_cast<__m128i*>(data + i);
+        _mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), shuffle));
+    }
+    bswap_scalar(data + i, n - i, word_size);
+}
+
+__attribute__((target("avx2")))
+inline void bswap_avx2(char* data, size_t n, size_t word_size) {
+    __m256i shuffle = _mm256_broadcastsi128_si256(bswap_shuffle(word_size));
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i* p = reinterpret_cast<__m256i*>(data + i);
+        _mm256_storeu_si256(p, _mm256_shuffle_epi8(_mm256_loadu_si256(p), shuffle));
+    }
+    bswap_scalar(data + i, n - i, word_size);
+}
+
+// One in-line transform stage, applied in place to every chunk that passes
+// through it. Checksums leave the data alone and keep a running digest;
+// the hash digest depends on chunk boundaries unless every chunk is a
+// multiple of 32 bytes. Byte swaps leave a trailing partial word as is.
+//
+//   none, crc32c, xxhash, xor, bswap16, bswap32, bswap64
+//
+// The kernel is picked once, at construction, for the best level the CPU
+// supports up to the requested one (crc32c has no AVX2 kernel).
+class transform {
+    public:
+        enum kind_type { none, crc32c, xxhash, xor_mask, bswap };
+
+    private:
+        static constexpr uint64_t xor_key = 0x5a3cc3a5f00f9669ull;
+
+        kind_type kind;
+        isa level;
+        size_t word_size;
+        uint64_t offset;
+        uint32_t crc;
+        hash64_state hash;
+
+    public:
+        transform(std::string const& name = "none", std::string const& level_name = "auto") :
+            kind(none),
+            level(parse_isa(level_name)),
+            word_size(1),
+            offset(0),
+            crc(0xffffffff)
+        {
+            if (name == "crc32c") kind = crc32c;
+            else if (name == "xxhash") kind = xxhash;
+            else if (name == "xor") kind = xor_mask;
+            else if (name == "bswap16") { kind = bswap; word_size = 2; }
+            else if (name == "bswap32") { kind = bswap; word_size = 4; }
+            else if (name == "bswap64") { kind = bswap; word_size = 8; }
+
+            if (kind == crc32c) level = std::min(level, isa::sse42);
+            if (kind == none) level = isa::scalar;
+        }
+
+        // whether name is one of the stages above; anything else is none
+        static bool known(std::string const& name) {
+            return name == "none" || name == "crc32c" || name == "xxhash" || name == "xor" ||
+                    name == "bswap16" || name == "bswap32" || name == "bswap64";
+        }
+
+        void apply(char* data, size_t n) {
+            switch (kind) {
+                case crc32c:
+                    crc = level == isa::scalar ? crc32c_scalar(crc, data, n) : crc32c_sse42(crc, data, n);
+                    break;
+                case xxhash:
+                    if (level == isa::avx2) hash64_avx2(hash, data, n);
+                    else if (level == isa::sse42) hash64_sse42(hash, data, n);
+                    else hash64_scalar(hash, data, n);
+                    break;
+                case xor_mask: {
+                    // keep the key in phase with the stream across chunks
+                    unsigned shift = 8 * (offset % 8);
+                    uint64_t key = shift ? (xor_key >> shift) | (xor_key << (64 - shift)) : xor_key;
+                    if (level == isa::avx2) xor_avx2(data, n, key);
+                    else if (level == isa::sse42) xor_sse42(data, n, key);
+                    else xor_scalar(data, n, key);
+                    break;
+                }
+                case bswap:
+                    if (level == isa::avx2) bswap_avx2(data, n, word_size);
+                    else if (level == isa::sse42) bswap_sse42(data, n, word_size);
+                    else bswap_scalar(data, n, word_size);
+                    break;
+                case none:
+                    break;
+            }
+            offset += n;
+        }
+
+        bool active() const { return kind != none; }
+        bool checksum() const { return kind == crc32c || kind == xxhash; }
+
+        // apply() only reads the data
+        bool read_only() const { return kind == none || checksum(); }
+
+        uint64_t digest() const {
+            if (kind == crc32c) return ~crc;
+            if (kind == xxhash) return hash.digest();
+            return 0;
+        }
+
+        uint64_t bytes() const { return offset; }
+
+        std::string name() const {
+            std::string res;
+            switch (kind) {
+                case crc32c: res = "crc32c"; break;
+                case xxhash: res = "xxhash"; break;
+                case xor_mask: res = "xor"; break;
+                case bswap: res = "bswap" + std::to_string(word_size * 8); break;
+                case none: return "none";
+            }
+            return res + " (" + isa_name(level) + ")";
+        }
+};
+
+}
+
+#endif
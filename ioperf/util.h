@@ -0,0 +1,128 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <type_traits>
+#include <string>
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace ygg {
+
+constexpr size_t cache_line_size = 64;
+
+// Before C++17, new only guarantees alignof(max_align_t), so the
+// alignas(cache_line_size) members of a heap object need not start a cache
+// line. Pipes and workers are built with make_aligned, which allocates the
+// object (and its shared_ptr control block) on a cache line boundary.
+template<typename T>
+struct cache_aligned_allocator {
+    using value_type = T;
+
+    cache_aligned_allocator() = default;
+    template<typename U> cache_aligned_allocator(cache_aligned_allocator<U> const&) {}
+
+    T* allocate(size_t n) {
+        void* p = nullptr;
+        if (posix_memalign(&p, cache_line_size, std::max<size_t>(n * sizeof(T), 1)) != 0) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t) { free(p); }
+
+    template<typename U> bool operator==(cache_aligned_allocator<U> const&) const { return true; }
+    template<typename U> bool operator!=(cache_aligned_allocator<U> const&) const { return false; }
+};
+
+template<typename T, typename... Args>
+std::shared_ptr<T> make_aligned(Args&&... args) {
+    return std::allocate_shared<T>(cache_aligned_allocator<T>(), std::forward<Args>(args)...);
+}
+
+// Contiguous view into a buffer owned by someone else.
+template<typename T>
+struct span {
+    T* data;
+    size_t size;
+};
+
+// Most buffer descriptors a vectored get/put or a pipe hands out at once;
+// a ring pipe needs two to cover its wrap-around.
+constexpr size_t max_segments = 8;
+
+// Implemented by sources and sinks that sit directly on a file descriptor,
+// so a worker can move data between two of them inside the kernel.
+class fd_endpoint {
+    public:
+        virtual int fd() const = 0;
+};
+
+// Instruction set a SIMD kernel is built for, best last.
+enum class isa { scalar, sse42, avx2 };
+
+inline char const* isa_name(isa level) {
+    switch (level) {
+        case isa::avx2: return "avx2";
+        case isa::sse42: return "sse4.2";
+        default: return "scalar";
+    }
+}
+
+inline isa detect_isa() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return isa::avx2;
+    if (__builtin_cpu_supports("sse4.2")) return isa::sse42;
+    return isa::scalar;
+}
+
+// "auto", "scalar", "sse4.2" or "avx2", capped at what the CPU supports
+inline isa parse_isa(std::string const& name) {
+    isa best = detect_isa();
+    isa wanted = best;
+    if (name == "scalar") wanted = isa::scalar;
+    else if (name == "sse4.2") wanted = isa::sse42;
+    else if (name == "avx2") wanted = isa::avx2;
+    return std::min(wanted, best);
+}
+
+// 262144 -> "256k", 3000 -> "3000"
+inline std::string format_size(size_t n) {
+    if (n >= (1 << 30) && n % (1 << 30) == 0) return std::to_string(n >> 30) + "G";
+    if (n >= (1 << 20) && n % (1 << 20) == 0) return std::to_string(n >> 20) + "M";
+    if (n >= (1 << 10) && n % (1 << 10) == 0) return std::to_string(n >> 10) + "k";
+    return std::to_string(n);
+}
+
+inline size_t next_pow2(size_t n) {
+    size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+// Maps a runtime size onto a compile-time one: calls f with an
+// std::integral_constant holding the smallest power of two in [N, Max]
+// that is at least n (or Max if n is larger). Used to pick template
+// instantiations such as fixed_pipe<Capacity> from the command line.
+template<size_t N, size_t Max>
+struct pow2_dispatch {
+    template<typename F>
+    static void call(size_t n, F&& f) {
+        if (n <= N) f(std::integral_constant<size_t, N>());
+        else pow2_dispatch<N * 2, Max>::call(n, f);
+    }
+};
+
+template<size_t Max>
+struct pow2_dispatch<Max, Max> {
+    template<typename F>
+    static void call(size_t, F&& f) {
+        f(std::integral_constant<size_t, Max>());
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include <climits>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <unistd.h>
+
+namespace ygg {
+
+// Wait strategies for pipes. A pipe waits with either
+//
+//   wait(guard, pred)  holding guard on the pipe's mutex, which is released
+//                      while waiting and held again once pred() is true
+//   wait(pred)         for lock-free pipes, where pred() reads atomics
+//
+// and calls notify() after every change another side may be waiting for,
+// once its own lock (if any) has been released, and notify_all() on stop.
+// Strategies that can park a thread count their waiters so notify() costs
+// no more than a fence and a load when nobody is parked.
+
+// Stands in for a std::unique_lock when there is nothing to release.
+struct no_lock {
+    void lock() {}
+    void unlock() {}
+};
+
+template<typename T>
+struct type_tag {
+    using type = T;
+};
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Busy-waits, with a pause between checks. Lowest wakeup latency, burns a
+// core for as long as it waits.
+class spin_wait {
+    public:
+        static char const* name() { return "spin"; }
+
+        template<typename Lock, typename Pred>
+        void wait(Lock& guard, Pred pred) {
+            while (!pred()) {
+                guard.unlock();
+                cpu_relax();
+                guard.lock();
+            }
+        }
+
+        template<typename Pred>
+        void wait(Pred pred) {
+            no_lock guard;
+            wait(guard, pred);
+        }
+
+        void notify() {}
+        void notify_all() {}
+};
+
+// Gives up the time slice between checks.
+class yield_wait {
+    public:
+        static char const* name() { return "yield"; }
+
+        template<typename Lock, typename Pred>
+        void wait(Lock& guard, Pred pred) {
+            while (!pred()) {
+                guard.unlock();
+                sched_yield();
+                guard.lock();
+            }
+        }
+
+        template<typename Pred>
+        void wait(Pred pred) {
+            no_lock guard;
+            wait(guard, pred);
+        }
+
+        void notify() {}
+        void notify_all() {}
+};
+
+// Parks on a condition variable straight away.
+class block_wait {
+    std::condition_variable cv;
+    std::mutex park_mutex; // only used by lock-free pipes
+    std::atomic<int> waiters;
+
+    public:
+        block_wait() : waiters(0) {}
+
+        static char const* name() { return "block"; }
+
+        template<typename Pred>
+        void wait(std::unique_lock<std::mutex>& guard, Pred pred) {
+            waiters++;
+            cv.wait(guard, pred);
+            waiters--;
+        }
+
+        template<typename Pred>
+        void wait(Pred pred) {
+            std::unique_lock<std::mutex> guard(park_mutex);
+            wait(guard, pred);
+        }
+
+        // Whoever is woken may be waiting for the other condition (full
+        // rather than empty), so more than one waiter means waking them all.
+        void notify() {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int n = waiters.load(std::memory_order_relaxed);
+            if (n == 0) return;
+
+            // a lock-free waiter may be between its check and its wait
+            { std::lock_guard<std::mutex> guard(park_mutex); }
+            if (n == 1) cv.notify_one();
+            else cv.notify_all();
+        }
+
+        void notify_all() {
+            { std::lock_guard<std::mutex> guard(park_mutex); }
+            cv.notify_all();
+        }
+};
+
+// Spins for a while, then parks on a futex. The futex word is a wakeup
+// sequence number that notify() bumps, so a wakeup between the waiter's
+// last check and its futex call makes the call return immediately. A
+// process_shared instance placed in shared memory also wakes waiters in
+// other processes.
+class spin_futex_wait {
+    static constexpr int spin_count = 1000;
+
+    std::atomic<uint32_t> sequence;
+    std::atomic<int> waiters;
+    int wait_op;
+    int wake_op;
+
+    void wake() {
+        sequence.fetch_add(1, std::memory_order_release);
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), wake_op, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    public:
+        spin_futex_wait(bool process_shared = false) :
+            sequence(0),
+            waiters(0),
+            wait_op(process_shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE),
+            wake_op(process_shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE) {}
+
+        static char const* name() { return "spin-futex"; }
+
+        template<typename Lock, typename Pred>
+        void wait(Lock& guard, Pred pred) {
+            for (int i = 0; i < spin_count; i++) {
+                if (pred()) return;
+                guard.unlock();
+                cpu_relax();
+                guard.lock();
+            }
+
+            while (true) {
+                waiters++;
+                uint32_t seen = sequence.load(std::memory_order_acquire);
+                if (pred()) {
+                    waiters--;
+                    return;
+                }
+
+                guard.unlock();
+                syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), wait_op, seen, nullptr, nullptr, 0);
+                guard.lock();
+                waiters--;
+            }
+        }
+
+        template<typename Pred>
+        void wait(Pred pred) {
+            no_lock guard;
+            wait(guard, pred);
+        }
+
+        void notify() {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiters.load(std::memory_order_relaxed) > 0) wake();
+        }
+
+        void notify_all() { wake(); }
+};
+
+// Calls f with a type_tag for the named strategy, or for Default.
+template<typename Default, typename F>
+void with_wait(std::string const& name, F&& f) {
+    if (name == "spin") f(type_tag<spin_wait>());
+    else if (name == "yield") f(type_tag<yield_wait>());
+    else if (name == "block") f(type_tag<block_wait>());
+    else if (name == "spin-futex") f(type_tag<spin_futex_wait>());
+    else f(type_tag<Default>());
+}
+
+}
+
+#endif
@@ -0,0 +1,379 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "sampling.h"
+#include "adaptive.h"
+#include "arena.h"
+#include "source.h"
+#include "sink.h"
+#include "pipe.h"
+
+namespace ygg {
+
+// Moves chunk_size bytes per iteration through its own buffer.
+class fixed_worker : public worker {
+    arena_buffer<char> buf;
+    std::shared_ptr<source> src;
+    std::shared_ptr<sink> dst;
+    std::atomic<bool> stopped;
+    progress_counter bytes_written;
+
+    latency_probe get_latency;
+    latency_probe put_latency;
+
+    public:
+        fixed_worker(std::shared_ptr<source> src, std::shared_ptr<sink> dst, size_t chunk_size) : 
+            buf(chunk_size),
+            src(src), 
+            dst(dst), 
+            stopped(false),
+            get_latency("source get"),
+            put_latency("sink put") {}
+
+        virtual void work(std::string name) override {
+            //std::cout << "Worker " << name << " starting..." << std::endl;
+            get_latency.label(name + " source get");
+            put_latency.label(name + " sink put");
+
+            while (!stopped) {
+                size_t count;
+                {
+                    scoped_latency t(get_latency);
+                    count = src->get(buf.data(), buf.size());
+                }
+
+                size_t write_idx = 0;
+                while (write_idx < count && !stopped) {
+                    scoped_latency t(put_latency);
+                    write_idx += dst->put(buf.data() + write_idx, count - write_idx);       
+                }
+                bytes_written.add(count);
+            }
+
+            //std::cout << "Worker " << name << " done." << std::endl;
+        }
+
+        virtual void poll(data_point& data) override {
+            data.time = clock::now();
+            data.count = bytes_written.load();
+        }
+
+        virtual void stop() override {
+            stopped = true;
+            src->stop();
+            dst->stop();
+        }
+};
+
+// Like fixed_worker, but the transfer size is tuned at runtime by a
+// chunk_controller between min_size and max_size.
+class adaptive_worker : public worker {
+    arena_buffer<char> buf;
+    std::shared_ptr<source> src;
+    std::shared_ptr<sink> dst;
+    chunk_controller controller;
+    std::atomic<bool> stopped;
+    progress_counter bytes_written;
+    std::atomic<size_t> chunk_size;
+
+    public:
+        adaptive_worker(std::shared_ptr<source> src, std::shared_ptr<sink> dst, size_t chunk_size, size_t min_size, size_t max_size) :
+            buf(std::max(min_size, max_size)),
+            src(src),
+            dst(dst),
+            controller(chunk_size, min_size, max_size),
+            stopped(false),
+            chunk_size(controller.size()) {}
+
+        virtual void work(std::string) override {
+            while (!stopped) {
+                size_t n = controller.size();
+                size_t count = src->get(buf.data(), n);
+                bool short_transfer = count < n;
+
+                size_t write_idx = 0;
+                while (write_idx < count && !stopped) {
+                    size_t written = dst->put(buf.data() + write_idx, count - write_idx);
+                    short_transfer = short_transfer || written < count - write_idx;
+                    write_idx += written;
+                }
+                bytes_written.add(count);
+
+                controller.record(count, short_transfer);
+                chunk_size.store(controller.size(), std::memory_order_relaxed);
+            }
+        }
+
+        virtual void poll(data_point& data) override {
+            data.time = clock::now();
+            data.count = bytes_written.load();
+            data.chunk_size = chunk_size.load(std::memory_order_relaxed);
+        }
+
+        virtual void stop() override {
+            stopped = true;
+            src->stop();
+            dst->stop();
+        }
+};
+
+// Lets the source write straight into the pipe's buffer instead of going
+// through a worker-owned buffer.
+class fill_worker : public worker {
+    std::shared_ptr<source> src;
+    std::shared_ptr<pipe> dst;
+    size_t chunk_size;
+    bool vectored;
+    std::atomic<bool> stopped;
+    progress_counter bytes_written;
+
+    public:
+        // vectored also fills the part of a ring pipe's free space that
+        // wraps around, in the same getv() call
+        fill_worker(std::shared_ptr<source> src, std::shared_ptr<pipe> dst, size_t chunk_size, bool vectored = false) :
+            src(src),
+            dst(dst),
+            chunk_size(chunk_size),
+            vectored(vectored),
+            stopped(false) {}
+
+        virtual void work(std::string) override {
+            span<char> segs[max_segments];
+            while (!stopped) {
+                size_t count = 0;
+                if (vectored) {
+                    size_t n = dst->reserve_segments(chunk_size, segs);
+                    count = n > 0 ? src->getv(segs, n) : 0;
+                } else {
+                    span<char> region = dst->reserve(chunk_size);
+                    count = region.size > 0 ? src->get(region.data, region.size) : 0;
+                }
+                dst->commit(count);
+                bytes_written.add(count);
+            }
+        }
+
+        virtual void poll(data_point& data) override {
+            data.time = clock::now();
+            data.count = bytes_written.load();
+        }
+
+        virtual void stop() override {
+            stopped = true;
+            src->stop();
+            dst->stop();
+        }
+};
+
+// Hands the readable part of the pipe's buffer to the sink in place.
+class drain_worker : public worker {
+    std::shared_ptr<pipe> src;
+    std::shared_ptr<sink> dst;
+    bool vectored;
+    std::atomic<bool> stopped;
+    progress_counter bytes_written;
+
+    // everything readable, including the part that wraps around, in one putv()
+    size_t drain_segments(span<char>* segs) {
+        size_t n = src->peek_segments(segs);
+        return n > 0 ? dst->putv(segs, n) : 0;
+    }
+
+    public:
+        drain_worker(std::shared_ptr<pipe> src, std::shared_ptr<sink> dst, bool vectored = false) :
+            src(src),
+            dst(dst),
+            vectored(vectored),
+            stopped(false) {}
+
+        virtual void work(std::string) override {
+            span<char> segs[max_segments];
+            while (!stopped) {
+                size_t read_idx = 0;
+                if (vectored) {
+                    read_idx = drain_segments(segs);
+                } else {
+                    span<char> region = src->peek();
+                    while (read_idx < region.size && !stopped) {
+                        read_idx += dst->put(region.data + read_idx, region.size - read_idx);
+                    }
+                }
+                src->consume(read_idx);
+                bytes_written.add(read_idx);
+            }
+        }
+
+        virtual void poll(data_point& data) override {
+            data.time = clock::now();
+            data.count = bytes_written.load();
+        }
+
+        virtual void stop() override {
+            stopped = true;
+            src->stop();
+            dst->stop();
+        }
+};
+
+// Moves data between two fd_endpoints without it passing through user
+// space: copy_file_range first, then sendfile, then splice through a
+// kernel pipe. Whenever the kernel rejects a method for this pair of
+// descriptors the next one is tried, ending in the buffered get/put loop.
+class kernel_copy_worker : public worker {
+    enum method_type { copy_file_range_method, sendfile_method, splice_method, buffered_method };
+
+    arena_buffer<char> buf;
+    std::shared_ptr<source> src;
+    std::shared_ptr<sink> dst;
+    int in_fd;
+    int out_fd;
+    int pipe_fds[2];
+    method_type method;
+    std::atomic<bool> stopped;
+    progress_counter bytes_written;
+
+    static bool rejected(int err) {
+        return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EBADF;
+    }
+
+    // one kernel-side transfer, -1 with errno set on failure
+    ssize_t transfer() {
+        switch (method) {
+            case copy_file_range_method:
+                return copy_file_range(in_fd, nullptr, out_fd, nullptr, buf.size(), 0);
+            case sendfile_method:
+                return sendfile(out_fd, in_fd, nullptr, buf.size());
+            case splice_method: {
+                ssize_t count = splice(in_fd, nullptr, pipe_fds[1], nullptr, buf.size(), SPLICE_F_MOVE);
+                for (ssize_t moved = 0; count > 0 && moved < count; ) {
+                    ssize_t res = splice(pipe_fds[0], nullptr, out_fd, nullptr, count - moved, SPLICE_F_MOVE);
+                    if (res < 0 && errno == EINTR) continue;
+                    if (res <= 0) {
+                        // the rest is already out of in_fd, so it has to go
+                        // through the buffered path before we fall back to it
+                        int err = res < 0 ? errno : EIO;
+                        bytes_written.add(moved + drain_pipe(count - moved));
+                        errno = err;
+                        return -1;
+                    }
+                    moved += res;
+                }
+                return count;
+            }
+            default:
+                return -1;
+        }
+    }
+
+    // forwards n bytes left in the splice pipe to dst, returns how many made it
+    size_t drain_pipe(size_t n) {
+        size_t read_idx = 0;
+        while (read_idx < n) {
+            ssize_t res = read(pipe_fds[0], buf.data() + read_idx, n - read_idx);
+            if (res < 0 && errno == EINTR) continue;
+            if (res <= 0) break;
+            read_idx += res;
+        }
+
+        size_t write_idx = 0;
+        while (write_idx < read_idx && !stopped) {
+            write_idx += dst->put(buf.data() + write_idx, read_idx - write_idx);
+        }
+        return write_idx;
+    }
+
+    public:
+        kernel_copy_worker(std::shared_ptr<source> src, std::shared_ptr<sink> dst, size_t chunk_size) :
+            buf(chunk_size),
+            src(src),
+            dst(dst),
+            in_fd(-1),
+            out_fd(-1),
+            pipe_fds{-1, -1},
+            method(buffered_method),
+            stopped(false)
+        {
+            auto in = dynamic_cast<fd_endpoint*>(src.get());
+            auto out = dynamic_cast<fd_endpoint*>(dst.get());
+            if (in && out) {
+                in_fd = in->fd();
+                out_fd = out->fd();
+                method = copy_file_range_method;
+            }
+        }
+
+        virtual ~kernel_copy_worker() {
+            if (pipe_fds[0] >= 0) close(pipe_fds[0]);
+            if (pipe_fds[1] >= 0) close(pipe_fds[1]);
+        }
+
+        char const* method_name() const {
+            switch (method) {
+                case copy_file_range_method: return "copy_file_range";
+                case sendfile_method: return "sendfile";
+                case splice_method: return "splice";
+                default: return "buffered";
+            }
+        }
+
+        virtual void work(std::string) override {
+            while (!stopped && method != buffered_method) {
+                if (method == splice_method && pipe_fds[0] < 0 && ::pipe(pipe_fds) != 0) {
+                    method = buffered_method;
+                    break;
+                }
+
+                ssize_t count = transfer();
+                if (count > 0) {
+                    bytes_written.add(count);
+                } else if (count == 0) {
+                    // EOF, start over like file_source does; an input we
+                    // can't rewind is simply done
+                    if (lseek(in_fd, 0, SEEK_SET) < 0) {
+                        perror("lseek");
+                        stopped = true;
+                    }
+                } else if (errno != EINTR && errno != EAGAIN) {
+                    if (!rejected(errno)) perror(method_name());
+                    method = static_cast<method_type>(method + 1);
+                }
+            }
+
+            while (!stopped) {
+                size_t count = src->get(buf.data(), buf.size());
+
+                size_t write_idx = 0;
+                while (write_idx < count && !stopped) {
+                    write_idx += dst->put(buf.data() + write_idx, count - write_idx);
+                }
+                bytes_written.add(count);
+            }
+        }
+
+        virtual void poll(data_point& data) override {
+            data.time = clock::now();
+            data.count = bytes_written.load();
+        }
+
+        virtual void stop() override {
+            stopped = true;
+            src->stop();
+            dst->stop();
+        }
+};
+
+}
+
+#endif